@@ -0,0 +1,437 @@
+/*
+ * libivee microbenchmarks.
+ *
+ * Every benchmark collects per-operation wall-clock latencies and reports their percentiles,
+ * throughput benchmark reports calls per second for 1..N threads.
+ * Results are printed in human-readable form and optionally written as JSON.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libivee/libivee.h>
+
+#define EMPTY_PAYLOAD_BIN   "empty_payload.bin"
+#define EMPTY_PAYLOAD_ELF   "empty_payload.elf64"
+#define PIO_PAYLOAD_ELF     "pio_payload.elf64"
+
+/* Benchmark parameters */
+static struct {
+    size_t iterations;
+    size_t lifecycle_iterations;
+    size_t max_threads;
+    unsigned duration_ms;
+    const char* json_path;
+} g_opts = {
+    .iterations = 100000,
+    .lifecycle_iterations = 1000,
+    .max_threads = 0,
+    .duration_ms = 1000,
+    .json_path = NULL,
+};
+
+/* JSON output, NULL if not requested */
+static FILE* g_json;
+static bool g_json_first = true;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char* what, int res)
+{
+    fprintf(stderr, "%s failed: %s\n", what, strerror(-res));
+    exit(EXIT_FAILURE);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t ua = *(const uint64_t*)a;
+    uint64_t ub = *(const uint64_t*)b;
+    return (ua > ub) - (ua < ub);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint64_t percentile(const uint64_t* sorted, size_t count, double p)
+{
+    size_t rank = (size_t)(p / 100.0 * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > count) {
+        rank = count;
+    }
+
+    return sorted[rank - 1];
+}
+
+struct summary
+{
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+static struct summary summarize(uint64_t* samples, size_t count)
+{
+    qsort(samples, count, sizeof(*samples), compare_u64);
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += samples[i];
+    }
+
+    return (struct summary) {
+        .mean = sum / count,
+        .p50 = percentile(samples, count, 50),
+        .p90 = percentile(samples, count, 90),
+        .p99 = percentile(samples, count, 99),
+        .p999 = percentile(samples, count, 99.9),
+        .max = samples[count - 1],
+    };
+}
+
+static void json_begin_entry(void)
+{
+    fprintf(g_json, "%s\n    ", (g_json_first ? "" : ","));
+    g_json_first = false;
+}
+
+/* Report latency samples of a benchmark, sorts them in place */
+static struct summary report_latency(const char* name, uint64_t* samples, size_t count)
+{
+    struct summary s = summarize(samples, count);
+
+    printf("%-28s %10zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+           name, count, s.mean, s.p50, s.p90, s.p99, s.p999, s.max);
+
+    if (g_json) {
+        json_begin_entry();
+        fprintf(g_json,
+                "{\"name\": \"%s\", \"unit\": \"ns\", \"samples\": %zu, \"mean\": %" PRIu64 ", "
+                "\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", "
+                "\"p99.9\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+                name, count, s.mean, s.p50, s.p90, s.p99, s.p999, s.max);
+    }
+
+    return s;
+}
+
+static void report_value(const char* name, const char* unit, double value)
+{
+    printf("%-28s %10.1f %s\n", name, value, unit);
+
+    if (g_json) {
+        json_begin_entry();
+        fprintf(g_json, "{\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f}", name, unit, value);
+    }
+}
+
+static void print_latency_header(void)
+{
+    printf("%-28s %10s %10s %10s %10s %10s %10s %10s\n",
+           "latency, ns", "samples", "mean", "p50", "p90", "p99", "p99.9", "max");
+}
+
+static ivee_t* create_loaded(const char* file, ivee_executable_format_t format)
+{
+    ivee_t* ivee = NULL;
+    int res = ivee_create(0, &ivee);
+    if (res != 0) {
+        die("ivee_create", res);
+    }
+
+    res = ivee_load_executable(ivee, file, format);
+    if (res != 0) {
+        die("ivee_load_executable", res);
+    }
+
+    return ivee;
+}
+
+static uint64_t timed_call(ivee_t* ivee, uint64_t rcx)
+{
+    ivee_arch_state_t state = { .rcx = rcx };
+
+    uint64_t start = now_ns();
+    int res = ivee_call(ivee, &state);
+    uint64_t end = now_ns();
+
+    if (res != 0) {
+        die("ivee_call", res);
+    }
+
+    return end - start;
+}
+
+/* Round-trip of a call into a function that returns right away */
+static void bench_empty_call(uint64_t* samples)
+{
+    ivee_t* ivee = create_loaded(EMPTY_PAYLOAD_ELF, IVEE_EXEC_ELF64);
+
+    /* Warm up caches and let KVM settle vcpu state */
+    for (size_t i = 0; i < g_opts.iterations / 10; ++i) {
+        timed_call(ivee, 0);
+    }
+
+    for (size_t i = 0; i < g_opts.iterations; ++i) {
+        samples[i] = timed_call(ivee, 0);
+    }
+
+    report_latency("call_empty", samples, g_opts.iterations);
+    ivee_destroy(ivee);
+}
+
+/* Call latency as a function of PIO exits guest makes per call */
+static void bench_pio_exits(uint64_t* samples)
+{
+    static const uint64_t exits[] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+    ivee_t* ivee = create_loaded(PIO_PAYLOAD_ELF, IVEE_EXEC_ELF64);
+    uint64_t base_p50 = 0;
+    uint64_t base_mean = 0;
+    size_t iterations = g_opts.iterations / 10;
+
+    for (size_t e = 0; e < sizeof(exits) / sizeof(*exits); ++e) {
+        for (size_t i = 0; i < iterations / 10; ++i) {
+            timed_call(ivee, exits[e]);
+        }
+
+        for (size_t i = 0; i < iterations; ++i) {
+            samples[i] = timed_call(ivee, exits[e]);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "call_pio_exits_%" PRIu64, exits[e]);
+        struct summary s = report_latency(name, samples, iterations);
+
+        if (exits[e] == 0) {
+            base_p50 = s.p50;
+            base_mean = s.mean;
+        } else if (exits[e] == exits[sizeof(exits) / sizeof(*exits) - 1]) {
+            /* Slope over the whole range is our per-exit cost */
+            report_value("pio_exit_cost_p50", "ns", ((double)s.p50 - base_p50) / exits[e]);
+            report_value("pio_exit_cost_mean", "ns", ((double)s.mean - base_mean) / exits[e]);
+        }
+    }
+
+    ivee_destroy(ivee);
+}
+
+/* Environment life cycle: create, load each executable format, destroy */
+static void bench_lifecycle(uint64_t* samples)
+{
+    size_t count = g_opts.lifecycle_iterations;
+    uint64_t* load[2] = { samples, samples + count };
+    uint64_t* create = samples + count * 2;
+    uint64_t* destroy = samples + count * 4;
+
+    for (size_t i = 0; i < count * 2; ++i) {
+        /* Alternate formats */
+        size_t format = i % 2;
+
+        ivee_t* ivee = NULL;
+        uint64_t start = now_ns();
+        int res = ivee_create(0, &ivee);
+        uint64_t end = now_ns();
+        if (res != 0) {
+            die("ivee_create", res);
+        }
+
+        create[i] = end - start;
+
+        start = now_ns();
+        if (format == 0) {
+            res = ivee_load_executable(ivee, EMPTY_PAYLOAD_BIN, IVEE_EXEC_BIN);
+        } else {
+            res = ivee_load_executable(ivee, EMPTY_PAYLOAD_ELF, IVEE_EXEC_ELF64);
+        }
+        end = now_ns();
+        if (res != 0) {
+            die("ivee_load_executable", res);
+        }
+
+        load[format][i / 2] = end - start;
+
+        start = now_ns();
+        ivee_destroy(ivee);
+        destroy[i] = now_ns() - start;
+    }
+
+    report_latency("ivee_create", create, count * 2);
+    report_latency("ivee_load_executable_bin", load[0], count);
+    report_latency("ivee_load_executable_elf", load[1], count);
+    report_latency("ivee_destroy", destroy, count * 2);
+}
+
+struct throughput_worker
+{
+    pthread_t thread;
+    pthread_barrier_t* barrier;
+    ivee_t* ivee;
+    volatile bool* stop;
+    uint64_t calls;
+};
+
+static void* throughput_thread(void* arg)
+{
+    struct throughput_worker* w = arg;
+
+    pthread_barrier_wait(w->barrier);
+
+    while (!*w->stop) {
+        ivee_arch_state_t state = { 0 };
+        int res = ivee_call(w->ivee, &state);
+        if (res != 0) {
+            die("ivee_call", res);
+        }
+
+        ++w->calls;
+    }
+
+    return NULL;
+}
+
+/* Aggregate empty call throughput of 1..N threads, each calling into its own environment */
+static void bench_throughput(void)
+{
+    struct throughput_worker* workers = calloc(g_opts.max_threads, sizeof(*workers));
+    if (!workers) {
+        die("calloc", -ENOMEM);
+    }
+
+    /* Powers of 2, always finishing with max_threads even if it is not one */
+    for (size_t nthreads = 1;; nthreads = (nthreads * 2 < g_opts.max_threads ? nthreads * 2 : g_opts.max_threads)) {
+        pthread_barrier_t barrier;
+        volatile bool stop = false;
+        pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+        for (size_t i = 0; i < nthreads; ++i) {
+            workers[i] = (struct throughput_worker) {
+                .barrier = &barrier,
+                .ivee = create_loaded(EMPTY_PAYLOAD_ELF, IVEE_EXEC_ELF64),
+                .stop = &stop,
+            };
+
+            pthread_create(&workers[i].thread, NULL, throughput_thread, &workers[i]);
+        }
+
+        pthread_barrier_wait(&barrier);
+        uint64_t start = now_ns();
+        usleep(g_opts.duration_ms * 1000);
+        stop = true;
+
+        uint64_t calls = 0;
+        for (size_t i = 0; i < nthreads; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            calls += workers[i].calls;
+            ivee_destroy(workers[i].ivee);
+        }
+
+        double seconds = (now_ns() - start) / 1e9;
+        pthread_barrier_destroy(&barrier);
+
+        char name[64];
+        snprintf(name, sizeof(name), "throughput_threads_%zu", nthreads);
+        report_value(name, "calls/s", calls / seconds);
+
+        if (nthreads >= g_opts.max_threads) {
+            break;
+        }
+    }
+
+    free(workers);
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-l lifecycle iterations] [-t max threads] "
+            "[-d throughput duration ms] [-j json output path]\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:t:d:j:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            g_opts.iterations = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            g_opts.lifecycle_iterations = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            g_opts.max_threads = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            g_opts.duration_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            g_opts.json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (g_opts.iterations < 100 || g_opts.lifecycle_iterations == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (g_opts.max_threads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_opts.max_threads = (ncpus > 0 ? ncpus : 1);
+    }
+
+    if (g_opts.json_path) {
+        g_json = fopen(g_opts.json_path, "w");
+        if (!g_json) {
+            die("fopen", -errno);
+        }
+
+        fprintf(g_json, "{\n  \"results\": [");
+    }
+
+    size_t nsamples = g_opts.iterations;
+    if (nsamples < g_opts.lifecycle_iterations * 6) {
+        nsamples = g_opts.lifecycle_iterations * 6;
+    }
+
+    uint64_t* samples = calloc(nsamples, sizeof(*samples));
+    if (!samples) {
+        die("calloc", -ENOMEM);
+    }
+
+    print_latency_header();
+    bench_empty_call(samples);
+    bench_pio_exits(samples);
+    bench_lifecycle(samples);
+    printf("\n");
+    bench_throughput();
+
+    free(samples);
+
+    if (g_json) {
+        fprintf(g_json, "\n  ]\n}\n");
+        fclose(g_json);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,13 @@
+/**
+ * libivee internal asynchronous call support
+ */
+
+#pragma once
+
+struct ivee_async;
+
+/**
+ * Stop worker thread of an environment and free its asynchronous call context.
+ * Waits for the call in flight, if any, to finish.
+ */
+void ivee_async_destroy(struct ivee_async* async);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory.h"
+
+/**
+ * Guest memory region an executable image asks for
+ */
+struct ivee_image_segment
+{
+    /* Page-aligned GPA and length of the region */
+    gpa_t gpa;
+    size_t length;
+
+    /* Guest memory protection bits */
+    enum ivee_memory_prot prot;
+
+    /* Page-aligned offset of region data in image file if region maps the file directly, -1 otherwise */
+    off_t file_offset;
+
+    /* Initial contents of an anonymous region, placed at data_offset. Rest of the region is zeroed. */
+    void* data;
+    size_t data_offset;
+    size_t data_size;
+};
+
+/**
+ * Parsed executable image.
+ *
+ * Image keeps the file open so that read-only segments can be mapped from it into any number
+ * of environments, sharing host page cache between them.
+ */
+struct ivee_image
+{
+    /* Executable file */
+    int fd;
+
+    /* Entry point address */
+    uint64_t entry_addr;
+
+    /* Guest memory regions to create, sorted by GPA */
+    size_t nsegments;
+    struct ivee_image_segment* segments;
+};
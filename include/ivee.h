@@ -0,0 +1,109 @@
+/**
+ * libivee internal execution environment definition
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libivee/libivee.h"
+#include "memory.h"
+#include "stats.h"
+#include "timer.h"
+#include "x86.h"
+
+struct ivee_kvm_vm;
+struct ivee_async;
+struct ivee_service;
+
+/**
+ * Registered host function for a hypercall number
+ */
+struct ivee_hypercall {
+    ivee_hypercall_fn_t fn;
+    void* ctx;
+};
+
+struct ivee {
+    /* Enabled environment capabilities */
+    enum ivee_capabilities caps;
+
+    /* Underlying KVM VM/VCPU */
+    struct ivee_kvm_vm* vm;
+
+    /* Active memory map */
+    struct ivee_memory_map memory_map;
+
+    /* Guest memory configuration with defaults filled in */
+    struct ivee_config config;
+
+    /* Guest memory layout of the loaded executable */
+    struct ivee_memory_layout layout;
+
+    /* Host memory backing for guest RAM */
+    enum ivee_memory_backing memory_backing;
+
+    /* x86 boot processor state */
+    struct x86_cpu_state x86_cpu;
+
+    /* vcpu XSAVE area buffer holds current guest extended state */
+    bool xsave_valid;
+
+    /* Loaded executable entry point */
+    uint64_t entry_addr;
+
+    /* Region that maps guest page table pages */
+    struct ivee_guest_memory_region* gpt_mr;
+
+    /* Guest memory is a private view of another environment */
+    bool is_clone;
+
+    /* Flag set to true if guest requested termination */
+    bool should_terminate;
+
+    /* Last call ended with a guest yield and can be resumed */
+    bool yielded;
+
+    /* Guest has been called into, so private memory views may differ from what backs them */
+    bool has_run;
+
+    /* Guest state reset policy */
+    enum ivee_reset_policy reset_policy;
+
+    /* x86 cpu state to go back to on reset */
+    struct x86_cpu_state reset_x86_cpu;
+
+    /* Scratch bitmap for guest dirty page logs, big enough for any region */
+    uint64_t* dirty_bitmap;
+
+    /* Performance counters */
+    struct ivee_instance_stats stats;
+
+    /* Asynchronous call context, created on first async call */
+    struct ivee_async* async;
+
+    /* Call timeout in ns, 0 if calls can run forever */
+    uint64_t call_timeout_ns;
+
+    /* Deadline of the current call */
+    struct ivee_timer call_timer;
+    bool call_timer_armed;
+
+    /* Protects kicking vcpu thread out of the current call */
+    pthread_mutex_t kick_lock;
+
+    /* Thread running the current call */
+    pthread_t vcpu_thread;
+    bool in_call;
+
+    /* Why current call is being kicked out: 0, ETIMEDOUT or ECANCELED */
+    int kick_reason;
+
+    /* Resident guest service loop, if running. Protected by kick_lock. */
+    struct ivee_service* service;
+
+    /* Host functions guest can call, indexed by hypercall number */
+    struct ivee_hypercall hypercalls[IVEE_HYPERCALL_MAX];
+};
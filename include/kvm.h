@@ -4,11 +4,14 @@
 
 #pragma once
 
+#include "libivee/abi.h"
+
 struct ivee_memory_map;
+struct ivee_guest_memory_region;
 struct x86_cpu_state;
 
-/* TODO: this will eventually have to move to runtime interface header */
-#define IVEE_PIO_EXIT_PORT 0x78u
+/* Signal used to kick vcpu threads out of KVM_RUN, the only one unblocked inside the guest */
+#define IVEE_KICK_SIGNAL SIGUSR1
 
 /**
  * Valid ivee exit reasons we care about
@@ -19,6 +22,12 @@ enum ivee_exit_reason {
 
     /** All other exit reasons are unexpected and unhandled */
     IVEE_EXIT_UNKNOWN,
+
+    /** Vcpu was kicked out by a signal or an exit request */
+    IVEE_EXIT_INTERRUPTED,
+
+    /** Guest executed HLT and waits for us to give it something to do */
+    IVEE_EXIT_HLT,
 };
 
 /**
@@ -36,6 +45,10 @@ struct ivee_pio_exit {
  */
 struct ivee_exit {
     enum ivee_exit_reason exit_reason;
+
+    /* TSC cycles spent inside KVM_RUN */
+    uint64_t run_cycles;
+
     union {
         struct ivee_pio_exit io;
     };
@@ -47,7 +60,8 @@ struct ivee_exit {
 struct ivee_kvm_vm;
 
 /**
- * Init static KVM context
+ * Init static KVM context.
+ * Installs a no-op IVEE_KICK_SIGNAL handler unless application has its own.
  *
  * \returns     0 on success, negative value on error
  */
@@ -65,22 +79,90 @@ void ivee_release_kvm_vm(struct ivee_kvm_vm* vm);
 
 /**
  * Take ivee vm flat memory map and turn it into kvm memory slots.
+ * Slots are updated incrementally: only regions added, removed or changed since last call are touched.
+ * Adjacent regions with contiguous host memory and the same KVM flags share a slot.
  *
  * \vm      KVM VM instance
- * \memmap  High level memory map.
- *          Guaranteed to not have overlaps and to have all adjacent regions merged.
+ * \memmap  High level memory map. Guaranteed to not have overlaps.
  */
 int ivee_set_kvm_memory_map(struct ivee_kvm_vm* vm, const struct ivee_memory_map* memmap);
 
 /**
- * Load x86 cpu state into KVM vcpu
+ * Fetch and clear log of guest writes to a memory region with dirty logging enabled.
+ *
+ * \vm      KVM VM instance
+ * \mr      Guest memory region, as was passed in last memory map
+ * \bitmap  Bitmap of written region pages, bit 0 is the first region page.
+ *          Should have enough room for region page count rounded up to 64 bits.
+ */
+int ivee_kvm_get_dirty_log(struct ivee_kvm_vm* vm, const struct ivee_guest_memory_region* mr, uint64_t* bitmap);
+
+/**
+ * Load dirty parts of x86 cpu state into KVM vcpu and mark them clean
  */
 int ivee_kvm_load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu);
 
 /**
  * Get KVM vcpu state and store it in output x86 state
+ *
+ * \parts   Mask of enum x86_cpu_state_part to fetch from the vcpu
+ */
+int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu, uint32_t parts);
+
+/**
+ * Get buffer for vcpu XSAVE area in standard format, allocating it on first use.
+ * Contents are only meaningful after ivee_kvm_store_xsave.
+ */
+void* ivee_kvm_xsave_area(struct ivee_kvm_vm* vm);
+
+/**
+ * Load vcpu extended state from XSAVE area buffer
+ */
+int ivee_kvm_load_xsave(struct ivee_kvm_vm* vm);
+
+/**
+ * Store vcpu extended state into XSAVE area buffer
+ */
+int ivee_kvm_store_xsave(struct ivee_kvm_vm* vm);
+
+/**
+ * Make current or next KVM_RUN exit immediately with IVEE_EXIT_INTERRUPTED.
+ * Vcpu thread has to be signalled with IVEE_KICK_SIGNAL as well if it is inside the guest.
+ */
+void ivee_kvm_request_exit(struct ivee_kvm_vm* vm);
+
+/**
+ * Clear pending exit request. Only safe to call when nobody can request exits anymore.
+ */
+void ivee_kvm_clear_exit_request(struct ivee_kvm_vm* vm);
+
+/**
+ * Let KVM complete I/O of the last exit without entering the guest.
+ * KVM finishes an exit on the next KVM_RUN, which should not happen in the middle of another call.
+ * Leaves an exit request behind.
+ */
+void ivee_kvm_complete_exit(struct ivee_kvm_vm* vm);
+
+/**
+ * Get mask of enum ivee_cpu_features guest vcpus have.
+ * Valid after ivee_init_kvm.
+ */
+uint64_t ivee_kvm_cpu_features(void);
+
+/**
+ * Get XCR0 guest vcpus start with, 0 if guest has no XSAVE
+ */
+uint64_t ivee_kvm_guest_xcr0(void);
+
+/**
+ * Get guest physical address width
+ */
+unsigned ivee_kvm_guest_phys_bits(void);
+
+/**
+ * Get vcpu TSC frequency in kHz
  */
-int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu);
+int ivee_kvm_get_tsc_khz(struct ivee_kvm_vm* vm);
 
 /**
  * Resume/start execution of KVM vcpu until next supported vmexit is initiated by the guest
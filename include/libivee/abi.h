@@ -0,0 +1,148 @@
+/**
+ * libivee guest runtime interface.
+ *
+ * Everything a payload needs to talk to the host: port numbers it writes to
+ * and register conventions for calls into the host.
+ * This header is meant to be usable from guest code, so it only depends on stdint.h.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Guest writes any value to this port to return from ivee_call
+ */
+#define IVEE_PIO_EXIT_PORT          0x78u
+
+/**
+ * Guest writes to this port just to exit to host, which resumes it right away
+ */
+#define IVEE_PIO_NOP_PORT           0x79u
+
+/**
+ * Guest writes any value to this port to return to host in the middle of a call.
+ * Host gets guest registers and ivee_call returns IVEE_CALL_YIELDED,
+ * ivee_resume continues right after the port write with registers host gives back.
+ */
+#define IVEE_PIO_YIELD_PORT         0x7Du
+
+/**
+ * Guest writes any value to this port to call a host function registered with ivee_register_hypercall.
+ *
+ * Hypercall number goes in RAX, arguments in RDI, RSI, RDX, R10, R8 and R9 (same as Linux syscalls).
+ * Result is returned in RAX, all other registers are preserved.
+ * Numbers without a registered function return -ENOSYS (-38).
+ */
+#define IVEE_PIO_HYPERCALL_PORT     0x7Au
+
+/**
+ * Number of hypercall table entries, valid hypercall numbers are [0, IVEE_HYPERCALL_MAX)
+ */
+#define IVEE_HYPERCALL_MAX          256
+
+/**
+ * Number of hypercall arguments passed in registers
+ */
+#define IVEE_HYPERCALL_ARGS         6
+
+/**
+ * Guest writes any value to this port to run a batch of hypercalls queued in a batch page.
+ *
+ * RDI holds GPA of the batch page, it should be page-aligned and writable by guest.
+ * Host runs header.count entries in order, stores their results and resumes the guest.
+ * RAX returns number of entries that were run, or a negative error if batch page is invalid.
+ */
+#define IVEE_PIO_BATCH_PORT         0x7Bu
+
+/**
+ * Number of entries in a batch page
+ */
+#define IVEE_BATCH_ENTRIES          63
+
+/**
+ * Single hypercall in a batch, one cache line
+ */
+struct ivee_batch_entry {
+    /* Hypercall number */
+    uint64_t nr;
+
+    /* Hypercall arguments, same as for IVEE_PIO_HYPERCALL_PORT */
+    uint64_t args[IVEE_HYPERCALL_ARGS];
+
+    /* Hypercall result, written by host */
+    uint64_t result;
+};
+
+/**
+ * Batch page header
+ */
+struct ivee_batch_header {
+    /* Number of queued entries, written by guest */
+    uint32_t count;
+
+    uint32_t reserved[15];
+};
+
+/**
+ * Shared page guest queues hypercalls in, takes a single exit to run them all
+ */
+struct ivee_batch_page {
+    struct ivee_batch_header header;
+    struct ivee_batch_entry entries[IVEE_BATCH_ENTRIES];
+};
+
+/**
+ * Guest writes any value to this port to wake host waiting for service request completions.
+ * Only needed when ivee_service_ring.host_waiting is set, see below.
+ */
+#define IVEE_PIO_SERVICE_NOTIFY_PORT    0x7Cu
+
+/**
+ * Number of requests in a service ring, a power of two
+ */
+#define IVEE_SERVICE_RING_ENTRIES       64
+
+/**
+ * Service request, one cache line
+ */
+struct ivee_service_request {
+    /* Operation code, meaning is up to guest */
+    uint64_t op;
+
+    /* Operation arguments */
+    uint64_t args[IVEE_HYPERCALL_ARGS];
+
+    /* Operation result, written by guest */
+    uint64_t result;
+};
+
+/**
+ * Single producer single consumer request ring shared by a host thread and a resident guest loop,
+ * see ivee_service_start. Host submits requests at head, guest completes them in order at tail.
+ * Indices are free-running, request i lives in requests[i % IVEE_SERVICE_RING_ENTRIES].
+ *
+ * Guest loop:
+ *  - While tail != head: handle requests[tail], store the result, then increment tail.
+ *    After updating tail, if host_waiting is set, write to IVEE_PIO_SERVICE_NOTIFY_PORT.
+ *  - When ring is empty and stop is set, return with IVEE_PIO_EXIT_PORT.
+ *  - When ring is empty guest may poll for a while and then go idle: set guest_idle,
+ *    check head and stop again, execute HLT if there is still nothing to do, clear guest_idle.
+ *
+ * Flag updates and index checks after them have to be ordered with MFENCE or a locked instruction,
+ * host does the same on its side, so that neither side sleeps when the other has just posted work.
+ */
+struct ivee_service_ring {
+    /* Written by host */
+    uint32_t head;
+    uint32_t stop;
+    uint32_t host_waiting;
+    uint32_t reserved0[13];
+
+    /* Written by guest */
+    uint32_t tail;
+    uint32_t guest_idle;
+    uint32_t reserved1[14];
+
+    struct ivee_service_request requests[IVEE_SERVICE_RING_ENTRIES];
+};
@@ -7,6 +7,8 @@ extern "C" {
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "abi.h"
+
 /**
  * APIC ID of a VCPU running inside an execution environment
  */
@@ -29,6 +31,37 @@ typedef enum ivee_capabilities {
     IVEE_CAP_MEMORY_ENCRYPTION = 0x0002,
 } ivee_capabilities_t;
 
+/**
+ * Guest CPU features.
+ * Vector extensions are only listed when their register state is enabled in guest XCR0,
+ * so payloads can rely on them without checking XGETBV themselves.
+ */
+typedef enum ivee_cpu_features {
+    IVEE_CPU_SSE3       = (1u << 0),
+    IVEE_CPU_SSSE3      = (1u << 1),
+    IVEE_CPU_SSE4_1     = (1u << 2),
+    IVEE_CPU_SSE4_2     = (1u << 3),
+    IVEE_CPU_POPCNT     = (1u << 4),
+    IVEE_CPU_AES        = (1u << 5),
+    IVEE_CPU_PCLMULQDQ  = (1u << 6),
+    IVEE_CPU_XSAVE      = (1u << 7),
+    IVEE_CPU_AVX        = (1u << 8),
+    IVEE_CPU_F16C       = (1u << 9),
+    IVEE_CPU_FMA        = (1u << 10),
+    IVEE_CPU_AVX2       = (1u << 11),
+    IVEE_CPU_BMI1       = (1u << 12),
+    IVEE_CPU_BMI2       = (1u << 13),
+    IVEE_CPU_AVX512F    = (1u << 14),
+    IVEE_CPU_AVX512DQ   = (1u << 15),
+    IVEE_CPU_AVX512CD   = (1u << 16),
+    IVEE_CPU_AVX512BW   = (1u << 17),
+    IVEE_CPU_AVX512VL   = (1u << 18),
+    IVEE_CPU_AVX512VNNI = (1u << 19),
+
+    /** 1GiB pages, guest page tables use them when available */
+    IVEE_CPU_PDPE1GB    = (1u << 20),
+} ivee_cpu_features_t;
+
 /**
  * Supported executable file formats
  */
@@ -49,6 +82,107 @@ typedef enum ivee_executable_format {
     IVEE_EXEC_ANY
 } ivee_executable_format_t;
 
+/**
+ * Host memory backing policies for guest RAM
+ */
+typedef enum ivee_memory_backing {
+    /**
+     * Shared memory backed by a memfd (default)
+     */
+    IVEE_MEMORY_SHARED = 0,
+
+    /**
+     * Shared memory backed by a memfd with transparent huge pages requested.
+     * Only has effect if host enables THP for shmem in "advise" mode.
+     */
+    IVEE_MEMORY_SHARED_THP,
+
+    /**
+     * Private anonymous memory with transparent huge pages requested.
+     * Environments using it can't be cloned or reset.
+     */
+    IVEE_MEMORY_PRIVATE_THP,
+
+    /**
+     * Hugetlb 2MiB pages backed by a memfd. Host should have enough huge pages reserved.
+     */
+    IVEE_MEMORY_HUGETLB_2M,
+
+    /**
+     * Hugetlb 1GiB pages backed by a memfd. Host should have enough huge pages reserved.
+     */
+    IVEE_MEMORY_HUGETLB_1G,
+} ivee_memory_backing_t;
+
+/**
+ * Execution environment configuration.
+ * Zero-initialized fields select defaults.
+ */
+typedef struct ivee_config {
+    /**
+     * Guest physical memory size, rounded up to 2MiB. Default is 1GiB, maximum is 64GiB.
+     * Executable, stack and heap should fit below the top 2MiB reserved for guest page tables.
+     */
+    uint64_t memory_size;
+
+    /**
+     * Stack size, rounded up to page size. Default is 64KiB.
+     */
+    uint64_t stack_size;
+
+    /**
+     * Page-aligned guest address right above the stack, where RSP points on every call.
+     * Default is right below page tables reserve at the top of guest memory.
+     */
+    uint64_t stack_top;
+
+    /**
+     * Size of a zeroed read-write heap region preallocated on executable load, rounded up to page size.
+     * Default is 0, no heap.
+     */
+    uint64_t heap_size;
+
+    /**
+     * Page-aligned guest address of the heap. Default is the first 2MiB boundary above the executable.
+     */
+    uint64_t heap_base;
+
+    /**
+     * Host memory backing for guest RAM, see ivee_set_memory_backing
+     */
+    ivee_memory_backing_t memory_backing;
+
+    /**
+     * Size of guest physical window right above guest memory where registered buffers are mapped,
+     * rounded up to 2MiB. Default is 1GiB, or whatever is left of the guest physical address space.
+     */
+    uint64_t buffer_window_size;
+} ivee_config_t;
+
+/**
+ * Guest memory layout of an execution environment with a loaded executable
+ */
+typedef struct ivee_memory_layout {
+    /** Guest physical memory size */
+    uint64_t memory_size;
+
+    /** Stack is [stack_base, stack_top) */
+    uint64_t stack_base;
+    uint64_t stack_top;
+
+    /** Heap is [heap_base, heap_base + heap_size), if any */
+    uint64_t heap_base;
+    uint64_t heap_size;
+
+    /** Guest page tables are [page_table_base, page_table_base + page_table_size) */
+    uint64_t page_table_base;
+    uint64_t page_table_size;
+
+    /** Registered buffers are mapped in [buffer_base, buffer_base + buffer_size) */
+    uint64_t buffer_base;
+    uint64_t buffer_size;
+} ivee_memory_layout_t;
+
 /**
  * Architectural state of a virtual cpu when switching to IVEE context.
  * Actual architecture to use for IVEE VCPU is always the same as host.
@@ -71,6 +205,71 @@ typedef struct ivee_arch_state {
     uint64_t r15;
 } ivee_arch_state_t;
 
+/**
+ * Register classes transferred by ivee_arch_state_ext_t
+ */
+typedef enum ivee_arch_state_ext_mask {
+    /**
+     * RSP and RFLAGS. Otherwise guest starts with RSP at the stack top and RFLAGS cleared.
+     */
+    IVEE_ARCH_STATE_RSP_RFLAGS = 0x1,
+
+    /**
+     * xmm0-15 and MXCSR
+     */
+    IVEE_ARCH_STATE_XMM = 0x2,
+
+    /**
+     * ymm0-15 and MXCSR, includes IVEE_ARCH_STATE_XMM
+     */
+    IVEE_ARCH_STATE_YMM = 0x4,
+
+    /**
+     * zmm0-31, k0-7 and MXCSR, includes IVEE_ARCH_STATE_YMM
+     */
+    IVEE_ARCH_STATE_ZMM = 0x8,
+} ivee_arch_state_ext_mask_t;
+
+/**
+ * Extended architectural state of a virtual cpu, see ivee_call_ext
+ */
+typedef struct ivee_arch_state_ext {
+    /** Mask of ivee_arch_state_ext_mask_t classes to transfer */
+    uint32_t mask;
+
+    /** MXCSR, 0 on input keeps guest MXCSR as is */
+    uint32_t mxcsr;
+
+    uint64_t rsp;
+    uint64_t rflags;
+
+    /** AVX-512 opmask registers */
+    uint64_t k[8];
+
+    /** Vector registers: xmmN is the low 16 bytes of zmm[N], ymmN is the low 32 bytes */
+    uint8_t zmm[32][64] __attribute__((aligned(64)));
+} ivee_arch_state_ext_t;
+
+/**
+ * Guest state reset policies
+ */
+typedef enum ivee_reset_policy {
+    /**
+     * Whatever guest leaves in its memory is seen by next calls (default)
+     */
+    IVEE_RESET_NONE = 0,
+
+    /**
+     * Guest memory writes are tracked and reverted on ivee_reset
+     */
+    IVEE_RESET_MANUAL,
+
+    /**
+     * Guest memory writes are tracked and reverted automatically after every call
+     */
+    IVEE_RESET_ON_CALL,
+} ivee_reset_policy_t;
+
 /**
  * Opaque handle to an execution environment
  */
@@ -81,6 +280,14 @@ typedef struct ivee ivee_t;
  */
 uint64_t ivee_list_platform_capabilities(void);
 
+/**
+ * List CPU features available to guest code.
+ * Every environment on this host gets the same guest CPU, so payloads may dispatch on this once.
+ *
+ * \returns     Mask of ivee_cpu_features_t, 0 if hypervisor is not available
+ */
+uint64_t ivee_list_cpu_features(void);
+
 /**
  * Create new execution environment container
  *
@@ -89,11 +296,29 @@ uint64_t ivee_list_platform_capabilities(void);
  */
 int ivee_create(ivee_capabilities_t caps, ivee_t** ivee);
 
+/**
+ * Create new execution environment container with custom guest memory layout
+ *
+ * \caps        Enabled environment capabilities.
+ * \config      Environment configuration, NULL for defaults. Not referenced after the call.
+ * \ivee        On success initialized pointer to an execption environment.
+ */
+int ivee_create_config(ivee_capabilities_t caps, const ivee_config_t* config, ivee_t** ivee);
+
 /**
  * Destroy an execution environment
  */
 void ivee_destroy(ivee_t* ivee);
 
+/**
+ * Select host memory backing for guest RAM allocated by following executable loads.
+ *
+ * Read-only executable image data is not affected. Guest regions are aligned in host
+ * address space the same way they are in guest physical space, so that KVM can map them with huge pages.
+ * Hugetlb backing is only used for regions made of whole huge pages, others use the default backing.
+ */
+int ivee_set_memory_backing(ivee_t* ivee, ivee_memory_backing_t backing);
+
 /**
  * Load a binary image into an execution environment.
  *
@@ -114,14 +339,455 @@ void ivee_destroy(ivee_t* ivee);
  */
 int ivee_load_executable(ivee_t* ivee, const char* file, ivee_executable_format_t format);
 
+/**
+ * Get guest memory layout of an execution environment with a loaded executable
+ */
+int ivee_get_memory_layout(const ivee_t* ivee, ivee_memory_layout_t* layout);
+
+/**
+ * Opaque handle to a parsed executable image
+ */
+typedef struct ivee_image ivee_image_t;
+
+/**
+ * Open and parse an executable image once, so that it can be loaded into many environments.
+ *
+ * Image keeps the file open. Read-only parts of the executable are mapped from it directly
+ * and shared by all environments that load the image, writable parts are read upfront.
+ *
+ * \file        Path to executable, see ivee_load_executable
+ * \format      Executable format or IVEE_EXEC_ANY to guess
+ * \img         On success initialized pointer to an image
+ */
+int ivee_image_open(const char* file, ivee_executable_format_t format, ivee_image_t** img);
+
+/**
+ * Close an executable image.
+ * Environments the image was loaded into are not affected.
+ */
+void ivee_image_close(ivee_image_t* img);
+
+/**
+ * Load a parsed executable image into an execution environment.
+ * This is what ivee_load_executable does after parsing the file, minus the parsing.
+ *
+ * Image is not modified, so it can be loaded into different environments concurrently.
+ *
+ * \ivee        Execution environment to load image into
+ * \img         Image to load
+ */
+int ivee_load_image(ivee_t* ivee, const ivee_image_t* img);
+
+/**
+ * Create a copy of an execution environment with a loaded executable.
+ *
+ * Guest memory of the new environment is a copy-on-write view of the template memory,
+ * so cloning does not parse or copy anything. Template may have already been called into,
+ * clone will start with whatever state guest has left in template memory.
+ *
+ * Template memory must not change while its clones are alive, i.e. template should not be called into.
+ * Clones can't be used as templates, cloning them returns -EINVAL.
+ * Neither can environments that have ever had a reset policy enabled, since their memory is a private view
+ * of the reset snapshot; cloning them returns -EBUSY. Enable resets on the clones instead.
+ *
+ * \template    Execution environment to clone
+ * \ivee        On success initialized pointer to a new execution environment
+ */
+int ivee_clone(const ivee_t* template, ivee_t** ivee);
+
+/**
+ * Positive result of a call that guest suspended by writing to IVEE_PIO_YIELD_PORT.
+ * State holds guest registers at the yield point, ivee_resume continues the call.
+ */
+#define IVEE_CALL_YIELDED 1
+
 /**
  * Execute a synchronous call into an execution environment with the specified architectural cpu state.
+ * Guest starts at the executable entry point with RSP at the stack top.
  *
  * \ivee        Exection environment to run
  * \state       Architectural cpu state on input. Updated after execution finished.
+ *
+ * Returns IVEE_CALL_YIELDED if guest yielded before finishing the call.
  */
 int ivee_call(ivee_t* ivee, ivee_arch_state_t* state);
 
+/**
+ * Continue a call that returned IVEE_CALL_YIELDED.
+ * Guest picks up right after its yield with RIP, RSP and RFLAGS it had and GPRs from state.
+ * Yield is only resumable until next call or reset of the execution environment.
+ *
+ * \ivee        Exection environment to run
+ * \state       Architectural cpu state on input. Updated after execution finished or yielded again.
+ *
+ * Returns -EINVAL if there is no yielded call to resume.
+ */
+int ivee_resume(ivee_t* ivee, ivee_arch_state_t* state);
+
+/**
+ * Execute a synchronous call with extended architectural cpu state.
+ *
+ * Only register classes selected by ext->mask are transferred in and out of the guest,
+ * so GPR-only calls are as cheap as ivee_call. Vector registers are transferred through
+ * the vcpu XSAVE area, guest XCR0 has to enable their state components.
+ *
+ * \ivee        Exection environment to run
+ * \state       Architectural cpu state on input. Updated after execution finished.
+ * \ext         Extended state on input, selected classes are updated after execution finished.
+ *              NULL is the same as ivee_call.
+ *
+ * Returns -ENOTSUP if guest does not support requested register classes.
+ */
+int ivee_call_ext(ivee_t* ivee, ivee_arch_state_t* state, ivee_arch_state_ext_t* ext);
+
+/**
+ * Limit wall-clock duration of following calls into an execution environment.
+ *
+ * Calls that run past the timeout are stopped and return -ETIMEDOUT.
+ * Guest memory is left as guest had it at that moment, environment can be called into again.
+ * Timeouts are served by a single library thread shared by all environments.
+ * Resident service loops are not limited by the timeout, use ivee_cancel or ivee_service_stop to end them.
+ *
+ * \ivee        Execution environment
+ * \timeout_ns  Timeout in nanoseconds, 0 to let calls run forever (default)
+ */
+int ivee_set_call_timeout(ivee_t* ivee, uint64_t timeout_ns);
+
+/**
+ * Stop a call currently running in an execution environment, if any. Stopped call returns -ECANCELED.
+ * Can be called from any thread.
+ *
+ * Calls are stopped by sending SIGUSR1 to the thread running them. Library installs a no-op
+ * handler for it unless application already has one, which then should tolerate these signals.
+ */
+int ivee_cancel(ivee_t* ivee);
+
+/**
+ * Host function guest can call with a hypercall, see libivee/abi.h for the guest side.
+ * Runs on the thread that called into the environment, while guest waits for the result.
+ *
+ * \ivee        Environment making the hypercall
+ * \ctx         Context pointer given at registration
+ * \args        Hypercall arguments from guest registers
+ *
+ * Returns value to put in guest RAX.
+ */
+typedef uint64_t (*ivee_hypercall_fn_t)(ivee_t* ivee, void* ctx, const uint64_t args[IVEE_HYPERCALL_ARGS]);
+
+/**
+ * Register a host function guest can call with hypercall number nr.
+ *
+ * Hypercalls are dispatched through a table, guest is resumed with the result right away
+ * without leaving ivee_call. Handlers can use ivee_cancel to abort the whole call instead.
+ * The same functions serve hypercalls guest queues in a batch page (see IVEE_PIO_BATCH_PORT).
+ * Clones inherit hypercalls registered in their template.
+ * Should not be called while environment is being called into.
+ *
+ * \ivee        Execution environment
+ * \nr          Hypercall number, less than IVEE_HYPERCALL_MAX
+ * \fn          Host function, NULL to unregister
+ * \ctx         Context pointer passed to fn
+ */
+int ivee_register_hypercall(ivee_t* ivee, uint32_t nr, ivee_hypercall_fn_t fn, void* ctx);
+
+/**
+ * Guest access to a registered buffer
+ */
+typedef enum ivee_buffer_prot {
+    IVEE_BUFFER_READ    = (1u << 0),
+    IVEE_BUFFER_WRITE   = (1u << 1),
+} ivee_buffer_prot_t;
+
+/**
+ * Map caller memory into guest physical memory so that calls can use it in place, without copies.
+ *
+ * Buffer gets its own guest physical range in the buffer window (see ivee_memory_layout_t).
+ * Window is identity mapped by guest page tables as non-executable ahead of time,
+ * so registration only adds a memory slot. Guest writes to a read-only buffer fail the call.
+ * Memory stays owned by the caller and should stay mapped until buffer is unregistered.
+ * Buffers are not restored by resets and are not inherited by clones.
+ * Should not be called while environment is being called into.
+ *
+ * \ivee        Execution environment with a loaded executable
+ * \hva         Page-aligned host address of the buffer
+ * \length      Buffer length in bytes, multiple of page size
+ * \prot        Guest access to the buffer, see ivee_buffer_prot_t
+ * \gpa         On success guest physical address of the buffer
+ *
+ * Returns -ENOSPC if buffer does not fit in the free part of the window.
+ */
+int ivee_register_buffer(ivee_t* ivee, void* hva, size_t length, unsigned prot, uint64_t* gpa);
+
+/**
+ * Unmap a buffer from guest physical memory
+ *
+ * \ivee        Execution environment
+ * \gpa         Guest physical address returned by ivee_register_buffer
+ */
+int ivee_unregister_buffer(ivee_t* ivee, uint64_t gpa);
+
+/**
+ * Handle to an asynchronous call
+ */
+typedef struct ivee_call ivee_call_t;
+
+/**
+ * Start an asynchronous call into an execution environment.
+ *
+ * Call is executed by a worker thread environment gets on its first asynchronous call
+ * and keeps until destroyed. Each environment can have one asynchronous call in flight,
+ * and should not be called into synchronously until the call is released.
+ *
+ * \ivee        Execution environment to run
+ * \state       Architectural cpu state on input, updated when call completes.
+ *              Should stay valid until then.
+ * \call        On success handle to the started call, valid until ivee_call_release
+ *
+ * Returns -EBUSY if environment already has a call which was not released.
+ */
+int ivee_call_async(ivee_t* ivee, ivee_arch_state_t* state, ivee_call_t** call);
+
+/**
+ * Get a file descriptor that becomes readable when call completes, to be used with poll/epoll.
+ * Descriptor is owned by the environment and is the same for all its calls, do not read or close it.
+ */
+int ivee_call_fd(const ivee_call_t* call);
+
+/**
+ * Check if asynchronous call has completed
+ *
+ * Returns -EAGAIN if call is still running, ivee_call result otherwise.
+ */
+int ivee_call_poll(ivee_call_t* call);
+
+/**
+ * Wait for asynchronous call to complete
+ *
+ * Returns ivee_call result.
+ */
+int ivee_call_wait(ivee_call_t* call);
+
+/**
+ * Release asynchronous call handle, waiting for the call to complete first.
+ * Environment can make another call after this.
+ */
+void ivee_call_release(ivee_call_t* call);
+
+/**
+ * Handle to a resident guest service loop
+ */
+typedef struct ivee_service ivee_service_t;
+
+/**
+ * Start a resident guest service loop.
+ *
+ * A thread of the library calls into the environment once and guest stays there, polling a request
+ * ring in its memory (see struct ivee_service_ring in libivee/abi.h). Requests and completions
+ * are passed through shared memory without any exits while guest is busy.
+ * Idle guest halts and is woken up by the next submission.
+ *
+ * Environment should not be called into by other means until the loop is stopped.
+ * Call timeout set with ivee_set_call_timeout does not apply to the loop, it runs until stopped or cancelled.
+ *
+ * \ivee        Execution environment with a loaded executable
+ * \ring_gpa    Page-aligned GPA of the ring in guest writable memory, initialized by this call
+ * \state       Guest state to enter loop with, RDI is set to ring_gpa
+ * \svc         On success handle to the started loop
+ */
+int ivee_service_start(ivee_t* ivee, uint64_t ring_gpa, const ivee_arch_state_t* state, ivee_service_t** svc);
+
+/**
+ * Submit a request to a guest service loop without waiting for it.
+ *
+ * Submissions and completions are not thread-safe: a single host thread should make them,
+ * or callers should serialize them.
+ *
+ * Returns -EAGAIN if there are IVEE_SERVICE_RING_ENTRIES requests not collected yet,
+ * -EPIPE if service loop has finished.
+ */
+int ivee_service_submit(ivee_service_t* svc, uint64_t op, const uint64_t args[IVEE_HYPERCALL_ARGS]);
+
+/**
+ * Wait for the oldest submitted request to complete and collect its result.
+ * Polls for a while before going to sleep.
+ *
+ * Returns -ENOENT if there are no submitted requests, -EPIPE if service loop has finished.
+ */
+int ivee_service_complete(ivee_service_t* svc, uint64_t* result);
+
+/**
+ * Submit a request and wait for its result, collecting everything submitted before it.
+ */
+int ivee_service_call(ivee_service_t* svc, uint64_t op, const uint64_t args[IVEE_HYPERCALL_ARGS], uint64_t* result);
+
+/**
+ * Ask guest service loop to finish and wait for it, freeing the handle.
+ * Loop that does not finish on its own can be stopped with ivee_cancel.
+ *
+ * \svc         Service loop to stop
+ * \state       Optional, final guest state
+ *
+ * Returns result of the service loop call, same as ivee_call would.
+ */
+int ivee_service_stop(ivee_service_t* svc, ivee_arch_state_t* state);
+
+/**
+ * Set guest state reset policy for an execution environment with a loaded executable.
+ *
+ * Enabling resets takes a snapshot of current guest state, so this is normally done right after
+ * ivee_load_executable or ivee_clone. Resetting clones restores them to the template state,
+ * unless they have been called into before enabling resets, then it is their own state at that point.
+ *
+ * Reset cost depends on the number of pages guest has written to, not on guest memory size.
+ * Only guest writes are tracked, changes made to guest memory by the host are not reverted.
+ *
+ * \ivee        Execution environment
+ * \policy      New reset policy
+ */
+int ivee_set_reset_policy(ivee_t* ivee, ivee_reset_policy_t policy);
+
+/**
+ * Revert execution environment to the state it had when resets were enabled.
+ */
+int ivee_reset(ivee_t* ivee);
+
+/**
+ * Number of guest ports with separate PIO exit counters in ivee_stats_t
+ */
+#define IVEE_STATS_PIO_PORTS 8
+
+/**
+ * Number of buckets in ivee_stats_t call latency histogram.
+ *
+ * Histogram is log-linear: values below 8 cycles get their own bucket, every power of 2 above
+ * that is split into 8 equal buckets, so bucket bounds are within 12.5% of recorded values.
+ */
+#define IVEE_STATS_HISTOGRAM_BUCKETS 496
+
+/**
+ * Execution environment performance counters.
+ * Durations are in TSC cycles, see \tsc_khz to convert them to time.
+ */
+typedef struct ivee_stats {
+    /** Number of ivee_call invocations */
+    uint64_t calls;
+
+    /** Number of ivee_call invocations that returned an error */
+    uint64_t failed_calls;
+
+    /** Number of times vcpu was entered */
+    uint64_t runs;
+
+    /** Number of PIO exits */
+    uint64_t io_exits;
+
+    /** Number of unexpected exits */
+    uint64_t unknown_exits;
+
+    /** Number of times vcpu was kicked out to enforce a timeout or a cancellation */
+    uint64_t interrupted_exits;
+
+    /** Number of times guest halted, service loop going idle */
+    uint64_t hlt_exits;
+
+    /** PIO exits by port, for first IVEE_STATS_PIO_PORTS distinct ports guest used */
+    struct {
+        uint16_t port;
+        uint64_t exits;
+    } pio_ports[IVEE_STATS_PIO_PORTS];
+
+    /** PIO exits to ports not in \pio_ports */
+    uint64_t pio_other_exits;
+
+    /** Cycles spent inside the vcpu */
+    uint64_t run_cycles;
+
+    /** Cycles spent in ivee_call outside the vcpu: state transfer, exit handling, resets */
+    uint64_t host_cycles;
+
+    /** Host TSC frequency */
+    uint64_t tsc_khz;
+
+    /** Histogram of ivee_call durations, see ivee_stats_bucket_cycles */
+    uint64_t call_cycles[IVEE_STATS_HISTOGRAM_BUCKETS];
+} ivee_stats_t;
+
+/**
+ * Get performance counters of an execution environment since its creation.
+ *
+ * Counters are updated by the thread calling into the environment without synchronization,
+ * so reading them concurrently with a call gives approximate values.
+ */
+int ivee_get_stats(const ivee_t* ivee, ivee_stats_t* stats);
+
+/**
+ * Get performance counters summed across all execution environments ever created by this process
+ */
+int ivee_get_global_stats(ivee_stats_t* stats);
+
+/**
+ * Get the lowest duration in cycles recorded into a histogram bucket
+ */
+uint64_t ivee_stats_bucket_cycles(size_t bucket);
+
+/**
+ * Estimate call duration percentile from the histogram, in cycles.
+ *
+ * \stats       Counters to use
+ * \percentile  Percentile in [0, 100]
+ *
+ * Returns lower bound of the bucket percentile falls into, 0 if there were no calls.
+ */
+uint64_t ivee_stats_percentile(const ivee_stats_t* stats, double percentile);
+
+/**
+ * Opaque handle to a pool of ready-to-call execution environments
+ */
+typedef struct ivee_pool ivee_pool_t;
+
+/**
+ * Create a pool of execution environments with the same executable loaded.
+ *
+ * Environments are created and loaded ahead of time so that acquiring one on a request path
+ * does not pay for VM creation and executable loading.
+ * Pool does not reset environments on release, what guest leaves in its memory is seen by the next user.
+ *
+ * \caps        Enabled environment capabilities, see ivee_create.
+ * \file        Path to executable, see ivee_load_executable.
+ * \format      Executable format or IVEE_EXEC_ANY to guess.
+ * \min         Number of environments to create upfront.
+ * \max         Maximum number of environments pool will own, including acquired ones.
+ * \pool        On success initialized pointer to a pool.
+ */
+int ivee_pool_create(ivee_capabilities_t caps,
+                     const char* file,
+                     ivee_executable_format_t format,
+                     size_t min,
+                     size_t max,
+                     ivee_pool_t** pool);
+
+/**
+ * Destroy a pool and all environments it owns.
+ * All acquired environments should be released back to the pool before this call.
+ */
+void ivee_pool_destroy(ivee_pool_t* pool);
+
+/**
+ * Take a ready-to-call execution environment from the pool.
+ * Creates a new environment if pool is empty, unless it already owns \max environments.
+ *
+ * \pool        Pool to acquire environment from
+ * \ivee        On success pointer to an execution environment owned by the pool
+ *
+ * Returns -EAGAIN if all \max environments are currently acquired.
+ */
+int ivee_pool_acquire(ivee_pool_t* pool, ivee_t** ivee);
+
+/**
+ * Return a previously acquired execution environment back to the pool.
+ */
+void ivee_pool_release(ivee_pool_t* pool, ivee_t* ivee);
+
 #ifdef __cplusplus
 }
 #endif
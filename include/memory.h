@@ -3,7 +3,9 @@
 #include <inttypes.h>
 #include <stdatomic.h>
 #include <stdbool.h>
-#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "libivee/libivee.h"
 
 /* We assume 64-bit VMs */
 typedef uint64_t gpa_t;
@@ -25,8 +27,8 @@ enum ivee_memory_prot
  */
 struct ivee_guest_memory_region
 {
-    /* Link to list of guest regions for containing VM */
-    LIST_ENTRY(ivee_guest_memory_region) link;
+    /* Memory map region belongs to */
+    struct ivee_memory_map* map;
 
     /* Region GFN range */
     gpa_t first_gfn;
@@ -40,12 +42,41 @@ struct ivee_guest_memory_region
 
     /* Guest memory protection bits */
     enum ivee_memory_prot prot;
+
+    /* File descriptor of memory object backing this region, owned by region.
+     * Anonymous guest memory is backed by a memfd, so that it can be mapped again elsewhere. */
+    int fd;
+
+    /* Offset of region data in backing memory object */
+    off_t fd_offset;
+
+    /* Kind of host memory backing the region */
+    enum ivee_memory_backing backing;
+
+    /* Host memory is mapped as PROT_READ */
+    bool host_ro;
+
+    /* Host memory is a private copy-on-write view of backing memory object,
+     * so the object does not reflect what is actually in the region */
+    bool is_private;
+
+    /* Ask hypervisor to log guest writes to this region */
+    bool log_dirty;
+
+    /* Read-only view of region contents at the time snapshot was taken, if any */
+    void* snapshot_hva;
+
+    /* Host memory belongs to the user, region does not unmap it and has no backing object */
+    bool user_owned;
+
+    /* Host memory is inside memory map reservation at reserved_base + GPA */
+    bool reserved;
 };
 
 /**
  * VM memory map definition.
  *
- * A flat memory map represents a list of guest physical address space regions
+ * A flat memory map represents a sorted array of guest physical address space regions
  * which may be backed by host virtual address regions. Unmapped regions trigger EPT faults
  * and exit into monitor (us).
  *
@@ -54,20 +85,60 @@ struct ivee_guest_memory_region
  */
 struct ivee_memory_map
 {
-    /* List of mapped guest memory regions */
-    LIST_HEAD(, ivee_guest_memory_region) regions;
+    /* Mapped guest memory regions sorted by GPA, regions never overlap */
+    struct ivee_guest_memory_region** regions;
+    size_t nregions;
+    size_t capacity;
+
+    /* Index of region last found by lookup, GPA accesses tend to hit the same region in a row */
+    _Atomic size_t last_hit;
+
+    /*
+     * PROT_NONE host address range reserved for guest physical memory [0, reserved_size).
+     * Regions inside of it are mapped at reserved_base + GPA, the rest of it is left inaccessible.
+     * Base is aligned for the largest huge pages, so that every region is aligned the same way as its GPA.
+     */
+    uint8_t* reserved_base;
+    size_t reserved_size;
 };
 
+/**
+ * Iterate over memory map regions in GPA order.
+ * Regions should not be added or removed while iterating.
+ * Loop index is named after mr, which has to be a plain variable name.
+ */
+#define IVEE_MEMORY_MAP_FOREACH(mr, map) \
+    for (size_t mr##_index = 0; mr##_index < (map)->nregions && ((mr) = (map)->regions[mr##_index], true); ++mr##_index)
+
 /**
  * Init fresh memory map with no regions
+ *
+ * \map         Memory map to init
+ * \size        Size of guest physical memory to reserve host address space for
  */
-int ivee_init_memory_map(struct ivee_memory_map* map);
+int ivee_init_memory_map(struct ivee_memory_map* map, size_t size);
 
 /**
- * Free all guest regions in this memory map
+ * Unmap all guest regions in this memory map, keeping host address space reservation for new ones
+ */
+void ivee_clear_memory_map(struct ivee_memory_map* map);
+
+/**
+ * Free all guest regions in this memory map and release host address space reservation
  */
 void ivee_free_memory_map(struct ivee_memory_map* map);
 
+/**
+ * Translate GPA to host address inside memory map reservation.
+ * Host address is only accessible if GPA is mapped by a region.
+ *
+ * Returns NULL if GPA is outside of reservation.
+ */
+static inline void* ivee_memory_map_reserved_hva(const struct ivee_memory_map* map, gpa_t gpa)
+{
+    return (gpa < map->reserved_size ? map->reserved_base + gpa : NULL);
+}
+
 /**
  * Allocate a block of host memory and map it into the guest memory map at specified GPA.
  *
@@ -76,9 +147,15 @@ void ivee_free_memory_map(struct ivee_memory_map* map);
  * \length      Length of the region in bytes, will be rounded up to guest page size
  *              Only affect what our process context can do with the memory, not what guest can
  * \mmap_fd     Optional argument to specify what fd to use for an mmap call
- *              If -1 then anonymous memory mapping will be created.
+ *              If -1 then anonymous memory will be created according to \backing.
+ *              Otherwise fd is mapped privately and region keeps its own duplicate of it.
+ * \mmap_offset Page-aligned offset in \mmap_fd to map, ignored for anonymous memory
  * \host_ro     Host memory is mapped as PROT_READ instead of default PROT_READ|PROT_WRITE
  *              This does not affect guest access permissions (see \prot argument for that)
+ * \backing     What kind of host memory to allocate when \mmap_fd is -1.
+ *              Host mapping is aligned for huge pages the same way GPA is.
+ *              Hugetlb backing falls back to IVEE_MEMORY_SHARED unless GPA and length
+ *              are both aligned to huge page size.
  * \prot        Guest access permissions
  *
  * Returns newly allocate guest memory region on success, stored in memory map.
@@ -87,9 +164,87 @@ struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* ma
                                                       gpa_t gpa,
                                                       size_t length,
                                                       int mmap_fd,
+                                                      off_t mmap_offset,
                                                       bool host_ro,
+                                                      enum ivee_memory_backing backing,
+                                                      enum ivee_memory_prot prot);
+
+/**
+ * Map host memory owned by the user into the guest memory map at specified GPA.
+ * Host memory is used as is, region never remaps or unmaps it.
+ *
+ * \map         Flat memory map to make changes to
+ * \gpa         Page-aligned GPA where region will start
+ * \hva         Page-aligned host address of the memory
+ * \length      Length of the region in bytes, multiple of guest page size
+ * \prot        Guest access permissions, guest can't write unless IVEE_WRITE is given
+ *
+ * Returns newly allocate guest memory region on success, stored in memory map.
+ */
+struct ivee_guest_memory_region* ivee_map_user_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      void* hva,
+                                                      size_t length,
                                                       enum ivee_memory_prot prot);
 
+/**
+ * Map a private copy-on-write view of another region's backing memory into the guest memory map.
+ * New region has the same GPA range and protection as the source.
+ *
+ * \map         Flat memory map to make changes to
+ * \src         Region to clone, it should not be a private view itself.
+ *
+ * Returns newly allocate guest memory region on success, stored in memory map.
+ */
+struct ivee_guest_memory_region* ivee_clone_host_memory(struct ivee_memory_map* map,
+                                                        const struct ivee_guest_memory_region* src);
+
+/**
+ * Take a snapshot of current region contents to restore pages from later.
+ *
+ * Backing memory object becomes the snapshot: it is not written to anymore and
+ * region host memory is turned into a private copy-on-write view of it.
+ * Regions that already are private views use their backing object as is, unless
+ * their contents could have diverged from it, in which case they are copied to a new one first.
+ *
+ * \mr          Region to snapshot
+ * \diverged    Private view could have been written to since it was mapped
+ */
+int ivee_snapshot_host_memory(struct ivee_guest_memory_region* mr, bool diverged);
+
+/**
+ * Restore region pages from its snapshot.
+ *
+ * \mr          Region with a snapshot
+ * \bitmap      Bitmap of region pages to restore, bit 0 is the first region page
+ */
+void ivee_restore_host_memory(struct ivee_guest_memory_region* mr, const uint64_t* bitmap);
+
+/**
+ * Drop region snapshot, if any
+ */
+void ivee_drop_host_memory_snapshot(struct ivee_guest_memory_region* mr);
+
+/**
+ * Find region that maps GPA in O(log n).
+ * Updates lookup hint in the map, so lookups are not const even though regions are left alone.
+ *
+ * Returns NULL if GPA is not mapped.
+ */
+struct ivee_guest_memory_region* ivee_memory_map_lookup(struct ivee_memory_map* map, gpa_t gpa);
+
+/**
+ * Get host address of a guest physical memory range.
+ *
+ * \map         Flat memory map to look in
+ * \gpa         First GPA of the range
+ * \length      Range length in bytes
+ * \prot        Guest access range should allow. IVEE_WRITE also requires host to be able to write.
+ *
+ * Returns NULL if range is not inside a single region or region does not allow access.
+ */
+void* ivee_memory_map_hva(struct ivee_memory_map* map, gpa_t gpa, size_t length, enum ivee_memory_prot prot);
+
 /**
  * Unmap guest region and free associated host memory
  */
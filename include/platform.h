@@ -4,6 +4,13 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 static inline void* ivee_alloc(size_t size)
 {
     return malloc(size);
@@ -14,7 +21,35 @@ static inline void* ivee_zalloc(size_t size)
     return calloc(size, 1);
 }
 
+static inline void* ivee_realloc(void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
 static inline void ivee_free(void* ptr)
 {
     free(ptr);
 }
+
+/* Cheap timestamp for performance counters, see ivee_stats_t */
+static inline uint64_t ivee_rdtsc(void)
+{
+    return __rdtsc();
+}
+
+/* Spin-wait loop hint */
+static inline void ivee_cpu_relax(void)
+{
+    _mm_pause();
+}
+
+/* Sleep while *addr == val, returns on wakeup, signal or if value was already different */
+static inline void ivee_futex_wait(uint32_t* addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void ivee_futex_wake(uint32_t* addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
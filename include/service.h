@@ -0,0 +1,28 @@
+/**
+ * libivee internal resident guest service loop support
+ */
+
+#pragma once
+
+struct ivee_service;
+
+/**
+ * Stop guest service loop, if it is still running, and free service context
+ */
+void ivee_service_destroy(struct ivee_service* svc);
+
+/**
+ * Guest service loop halted, block vcpu thread until there is something for guest to do.
+ * Returns early on spurious wakeups, guest is expected to check its ring and halt again.
+ */
+void ivee_service_idle(struct ivee_service* svc);
+
+/**
+ * Guest completed requests host is waiting for
+ */
+void ivee_service_notify(struct ivee_service* svc);
+
+/**
+ * Wake vcpu thread from ivee_service_idle so that it notices it is being kicked out
+ */
+void ivee_service_kick(struct ivee_service* svc);
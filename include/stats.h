@@ -0,0 +1,101 @@
+/**
+ * libivee internal performance counters
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "libivee/libivee.h"
+#include "kvm.h"
+
+/**
+ * Performance counters of a live execution environment
+ */
+struct ivee_instance_stats
+{
+    /* Link to the global list of live instances */
+    LIST_ENTRY(ivee_instance_stats) link;
+
+    struct ivee_stats counters;
+};
+
+/**
+ * Reset instance counters and add them to global aggregate.
+ * Counters are still owned by the instance and read by ivee_get_global_stats until unregistered.
+ */
+void ivee_stats_register(struct ivee_instance_stats* stats);
+
+/**
+ * Fold instance counters into global aggregate for good
+ */
+void ivee_stats_unregister(struct ivee_instance_stats* stats);
+
+/**
+ * Map cycle count to its histogram bucket
+ */
+static inline size_t ivee_stats_bucket(uint64_t cycles)
+{
+    if (cycles < 8) {
+        return cycles;
+    }
+
+    /* Bucket is given by position of the highest bit and 3 bits following it */
+    unsigned shift = 63 - __builtin_clzll(cycles) - 3;
+    return (shift + 1) * 8 + ((cycles >> shift) & 7);
+}
+
+/**
+ * Account for a vcpu exit
+ */
+static inline void ivee_stats_record_exit(struct ivee_stats* stats, const struct ivee_exit* exit)
+{
+    ++stats->runs;
+    stats->run_cycles += exit->run_cycles;
+
+    if (exit->exit_reason == IVEE_EXIT_INTERRUPTED) {
+        ++stats->interrupted_exits;
+        return;
+    } else if (exit->exit_reason == IVEE_EXIT_HLT) {
+        ++stats->hlt_exits;
+        return;
+    } else if (exit->exit_reason != IVEE_EXIT_IO) {
+        ++stats->unknown_exits;
+        return;
+    }
+
+    ++stats->io_exits;
+
+    /* Slots are taken in order and never freed, so first empty slot ends the search */
+    for (size_t i = 0; i < IVEE_STATS_PIO_PORTS; ++i) {
+        if (stats->pio_ports[i].exits == 0) {
+            stats->pio_ports[i].port = exit->io.port;
+        }
+
+        if (stats->pio_ports[i].port == exit->io.port) {
+            ++stats->pio_ports[i].exits;
+            return;
+        }
+    }
+
+    ++stats->pio_other_exits;
+}
+
+/**
+ * Account for a finished call
+ *
+ * \cycles      Total call duration
+ * \run_cycles  Part of call duration spent inside the vcpu
+ * \res         Call result
+ */
+static inline void ivee_stats_record_call(struct ivee_stats* stats, uint64_t cycles, uint64_t run_cycles, int res)
+{
+    ++stats->calls;
+    if (res < 0) {
+        ++stats->failed_calls;
+    }
+
+    stats->host_cycles += (cycles > run_cycles ? cycles - run_cycles : 0);
+    ++stats->call_cycles[ivee_stats_bucket(cycles)];
+}
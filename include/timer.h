@@ -0,0 +1,43 @@
+/**
+ * libivee internal deadline timers
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Timer armed on the shared timer thread
+ */
+struct ivee_timer
+{
+    /* CLOCK_MONOTONIC deadline in ns */
+    uint64_t deadline;
+
+    /* Position in timer heap while armed */
+    size_t heap_index;
+
+    /* Called on timer thread when deadline passes, with timer lock held.
+     * Callback can't arm or disarm timers. */
+    void (*expire)(struct ivee_timer* timer);
+};
+
+/**
+ * Current CLOCK_MONOTONIC time in ns
+ */
+uint64_t ivee_monotonic_ns(void);
+
+/**
+ * Arm a timer. Timer thread is only woken up if it sleeps past the deadline.
+ *
+ * \timer       Timer with expire callback set, should not be armed
+ * \deadline    CLOCK_MONOTONIC deadline in ns
+ */
+int ivee_timer_start(struct ivee_timer* timer, uint64_t deadline);
+
+/**
+ * Disarm a timer. Once this returns expire callback is not running and will not be called.
+ * Does nothing if timer has already expired.
+ */
+void ivee_timer_stop(struct ivee_timer* timer);
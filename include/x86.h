@@ -6,7 +6,24 @@
 
 #define X86_PTE_PRESENT     (1ul << 0)
 #define X86_PTE_RW          (1ul << 1)
+#define X86_PTE_PS          (1ul << 7)  /* Large page leaf entry in PDPE or PDE */
 #define X86_PTE_NX          (1ul << 63)
+#define X86_PTE_ADDR_MASK   (0x000FFFFFFFFFF000ul)
+
+#define X86_CR4_PAE         (1ul << 5)
+#define X86_CR4_OSFXSR      (1ul << 9)  /* FXSAVE/FXRSTOR and SSE */
+#define X86_CR4_OSXMMEXCPT  (1ul << 10) /* Unmasked SIMD floating point exceptions */
+#define X86_CR4_OSXSAVE     (1ul << 18) /* XSAVE and XCR0 */
+
+/* Long mode 4-level paging: level 0 entries are PTEs, level 3 entries are PML4Es */
+#define X86_PAGING_LEVELS   4
+#define X86_VA_BITS         48
+
+/* Number of 4KiB pages mapped by a single entry at paging level */
+#define X86_LEVEL_PAGES(level) (1ul << (9 * (level)))
+
+/* Index of entry mapping gfn in a table at paging level */
+#define X86_LEVEL_INDEX(gfn, level) (((gfn) >> (9 * (level))) & (X86_PTES_PER_PAGE - 1))
 
 /**
  * x86 segment descriptor
@@ -59,6 +76,20 @@ struct x86_dtbl
     uint16_t limit;
 };
 
+/**
+ * Parts of x86 cpu state that are synchronized with a virtual cpu independently
+ */
+enum x86_cpu_state_part
+{
+    /** General purpose registers, RIP and RFLAGS */
+    X86_CPU_STATE_REGS  = (1u << 0),
+
+    /** Segment registers, descriptor tables and control registers */
+    X86_CPU_STATE_SREGS = (1u << 1),
+
+    X86_CPU_STATE_ALL   = X86_CPU_STATE_REGS | X86_CPU_STATE_SREGS,
+};
+
 /**
  * Virtualized x86 cpu state
  */
@@ -80,7 +111,11 @@ struct x86_cpu_state
 
     struct x86_dtbl gdt, idt;
 
-    uint32_t cr0, cr2, cr3, cr4;
-    uint32_t efer;
-    uint32_t apic_base;
+    /* 64-bit wide in long mode, page tables can live above 4GiB */
+    uint64_t cr0, cr2, cr3, cr4;
+    uint64_t efer;
+    uint64_t apic_base;
+
+    /* Parts changed by us since they were last loaded into a virtual cpu (see enum x86_cpu_state_part) */
+    uint32_t dirty;
 };
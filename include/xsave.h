@@ -0,0 +1,44 @@
+/**
+ * libivee internal XSAVE area helpers
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "libivee/libivee.h"
+
+/* XSAVE state components we transfer */
+#define X86_XFEATURE_FP         0
+#define X86_XFEATURE_SSE        1
+#define X86_XFEATURE_YMM        2
+#define X86_XFEATURE_OPMASK     5
+#define X86_XFEATURE_ZMM_HI256  6
+#define X86_XFEATURE_HI16_ZMM   7
+
+#define X86_XFEATURE_MASK(f)    (1ull << (f))
+
+/* Legacy region components, available with FXSAVE even if guest has no XSAVE */
+#define X86_XSAVE_LEGACY_FEATURES   (X86_XFEATURE_MASK(X86_XFEATURE_FP) | X86_XFEATURE_MASK(X86_XFEATURE_SSE))
+
+/* Legacy region and header offsets in standard format XSAVE area */
+#define X86_XSAVE_MXCSR_OFFSET      24
+#define X86_XSAVE_XMM_OFFSET        160
+#define X86_XSAVE_XSTATE_BV_OFFSET  512
+
+/**
+ * Get mask of XSAVE state components needed to transfer ext->mask register classes.
+ * Returns 0 if host does not support some of them.
+ */
+uint64_t ivee_xsave_features(uint32_t mask);
+
+/**
+ * Put registers selected by ext->mask into standard format XSAVE area, leaving the rest as is.
+ */
+void ivee_xsave_put(void* area, const struct ivee_arch_state_ext* ext);
+
+/**
+ * Get registers selected by ext->mask from standard format XSAVE area.
+ * Components in their init state read as zeroes.
+ */
+void ivee_xsave_get(const void* area, struct ivee_arch_state_ext* ext);
@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "async.h"
+#include "ivee.h"
+
+/*
+ * Asynchronous calls are executed by a worker thread each environment gets on its first async call.
+ * Worker stays with the environment for its lifetime, so that KVM sees the same thread entering
+ * the vcpu every time. With at most one call in flight per environment the call handle is
+ * preallocated as part of the context and submitting a call does not allocate anything.
+ */
+
+struct ivee_call
+{
+    /* Context this call belongs to */
+    struct ivee_async* async;
+
+    /* Caller state to run with and to update on completion */
+    struct ivee_arch_state* state;
+
+    /* Call result, valid once done is set */
+    int result;
+    atomic_bool done;
+};
+
+struct ivee_async
+{
+    /* Environment we make calls into */
+    struct ivee* ivee;
+
+    /* Worker thread */
+    pthread_t thread;
+
+    /* Protects worker wakeup conditions */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Worker should exit */
+    bool stop;
+
+    /* Call was submitted and worker has not picked it up yet */
+    bool submitted;
+
+    /* Call handle is owned by the caller */
+    bool in_use;
+
+    /* Signalled when call completes */
+    int eventfd;
+
+    /* The only call handle */
+    struct ivee_call call;
+};
+
+static void* worker_thread(void* arg)
+{
+    struct ivee_async* async = arg;
+
+    while (true) {
+        pthread_mutex_lock(&async->lock);
+        while (!async->stop && !async->submitted) {
+            pthread_cond_wait(&async->cond, &async->lock);
+        }
+
+        if (!async->submitted) {
+            pthread_mutex_unlock(&async->lock);
+            break;
+        }
+
+        async->submitted = false;
+        pthread_mutex_unlock(&async->lock);
+
+        struct ivee_call* call = &async->call;
+        call->result = ivee_call(async->ivee, call->state);
+        atomic_store_explicit(&call->done, true, memory_order_release);
+
+        /* Done flag is set before eventfd becomes readable */
+        uint64_t one = 1;
+        ssize_t res = write(async->eventfd, &one, sizeof(one));
+        (void)res;
+    }
+
+    return NULL;
+}
+
+static int create_async(struct ivee* ivee, struct ivee_async** out_async)
+{
+    int res = 0;
+
+    struct ivee_async* async = ivee_zalloc(sizeof(*async));
+    if (!async) {
+        return -ENOMEM;
+    }
+
+    async->ivee = ivee;
+    async->call.async = async;
+
+    async->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (async->eventfd < 0) {
+        res = -errno;
+        ivee_free(async);
+        return res;
+    }
+
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    /* Process signals should not be delivered to the worker, KVM sets vcpu signal mask for KVM_RUN itself */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = -pthread_create(&async->thread, NULL, worker_thread, async);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (res != 0) {
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        close(async->eventfd);
+        ivee_free(async);
+        return res;
+    }
+
+    *out_async = async;
+    return 0;
+}
+
+void ivee_async_destroy(struct ivee_async* async)
+{
+    if (!async) {
+        return;
+    }
+
+    pthread_mutex_lock(&async->lock);
+    async->stop = true;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    pthread_join(async->thread, NULL);
+
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    close(async->eventfd);
+    ivee_free(async);
+}
+
+int ivee_call_async(struct ivee* ivee, struct ivee_arch_state* state, struct ivee_call** out_call)
+{
+    int res = 0;
+
+    if (!ivee || !state || !out_call) {
+        return -EINVAL;
+    }
+
+    if (!ivee->async) {
+        res = create_async(ivee, &ivee->async);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    struct ivee_async* async = ivee->async;
+    if (async->in_use) {
+        return -EBUSY;
+    }
+
+    struct ivee_call* call = &async->call;
+    call->state = state;
+    call->result = 0;
+    atomic_store_explicit(&call->done, false, memory_order_relaxed);
+    async->in_use = true;
+
+    pthread_mutex_lock(&async->lock);
+    async->submitted = true;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    *out_call = call;
+    return 0;
+}
+
+int ivee_call_fd(const struct ivee_call* call)
+{
+    if (!call) {
+        return -EINVAL;
+    }
+
+    return call->async->eventfd;
+}
+
+int ivee_call_poll(struct ivee_call* call)
+{
+    if (!call) {
+        return -EINVAL;
+    }
+
+    if (!atomic_load_explicit(&call->done, memory_order_acquire)) {
+        return -EAGAIN;
+    }
+
+    return call->result;
+}
+
+int ivee_call_wait(struct ivee_call* call)
+{
+    if (!call) {
+        return -EINVAL;
+    }
+
+    struct pollfd pfd = {
+        .fd = call->async->eventfd,
+        .events = POLLIN,
+    };
+
+    while (!atomic_load_explicit(&call->done, memory_order_acquire)) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    return call->result;
+}
+
+void ivee_call_release(struct ivee_call* call)
+{
+    if (!call) {
+        return;
+    }
+
+    ivee_call_wait(call);
+
+    /* Next call starts with eventfd not readable */
+    uint64_t count;
+    ssize_t res = read(call->async->eventfd, &count, sizeof(count));
+    (void)res;
+
+    call->async->in_use = false;
+}
@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gelf.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "image.h"
+#include "x86.h"
+
+/* Where flat binaries are loaded and start executing */
+#define IVEE_BIN_LOAD_ADDR 0x400000
+
+/* Describe flat binary image: the file is mapped into guest directly for readonly */
+static int parse_bin(struct ivee_image* img)
+{
+    struct stat st;
+    if (fstat(img->fd, &st) != 0) {
+        return -errno;
+    }
+
+    size_t size = st.st_size;
+    if (size == 0) {
+        return -EINVAL;
+    }
+
+    img->segments = ivee_zalloc(sizeof(*img->segments));
+    if (!img->segments) {
+        return -ENOMEM;
+    }
+
+    img->segments[0] = (struct ivee_image_segment) {
+        .gpa = IVEE_BIN_LOAD_ADDR,
+        .length = (size + X86_PAGE_SIZE - 1) & ~(X86_PAGE_SIZE - 1),
+        .prot = IVEE_READ | IVEE_EXEC,
+        .file_offset = 0,
+    };
+
+    img->nsegments = 1;
+    img->entry_addr = IVEE_BIN_LOAD_ADDR;
+    return 0;
+}
+
+/*
+ * Describe ELF PT_LOAD segment as up to 2 guest regions.
+ *
+ * Read-only segments are mapped straight from the file, so that all instances loading the same
+ * binary share its page cache. Only writable segments, segments not laid out in the file
+ * the same way as in memory, and the zero-filled tails of segments get anonymous memory
+ * with file contents copied into it.
+ */
+static int parse_elf64_segment(struct ivee_image* img, const GElf_Phdr* phdr)
+{
+    if (phdr->p_memsz == 0) {
+        return 0;
+    }
+
+    if (phdr->p_filesz > phdr->p_memsz) {
+        return -EINVAL;
+    }
+
+    enum ivee_memory_prot prot = (phdr->p_flags & PF_X ? IVEE_EXEC : 0) |
+                                 (phdr->p_flags & PF_R ? IVEE_READ : 0) |
+                                 (phdr->p_flags & PF_W ? IVEE_WRITE : 0);
+
+    gpa_t first_gpa = phdr->p_vaddr & ~(X86_PAGE_SIZE - 1);
+    gpa_t end_gpa = (phdr->p_vaddr + phdr->p_memsz + (X86_PAGE_SIZE - 1)) & ~(X86_PAGE_SIZE - 1);
+    gpa_t file_end_gpa = phdr->p_vaddr + phdr->p_filesz;
+    size_t page_offset = phdr->p_vaddr - first_gpa;
+
+    /*
+     * File mapping can only cover the whole pages of file data, unless there is nothing
+     * past file data in this segment, in which case we expose the rest of the last page like linux does.
+     */
+    size_t mapped = 0;
+    if (!(prot & IVEE_WRITE) && page_offset == (phdr->p_offset & (X86_PAGE_SIZE - 1))) {
+        if (phdr->p_filesz == phdr->p_memsz) {
+            mapped = end_gpa - first_gpa;
+        } else {
+            mapped = (file_end_gpa & ~(X86_PAGE_SIZE - 1)) - first_gpa;
+        }
+    }
+
+    if (mapped > 0) {
+        img->segments[img->nsegments++] = (struct ivee_image_segment) {
+            .gpa = first_gpa,
+            .length = mapped,
+            .prot = prot,
+            .file_offset = phdr->p_offset - page_offset,
+        };
+    }
+
+    gpa_t anon_gpa = first_gpa + mapped;
+    if (anon_gpa == end_gpa) {
+        return 0;
+    }
+
+    struct ivee_image_segment* seg = &img->segments[img->nsegments++];
+    *seg = (struct ivee_image_segment) {
+        .gpa = anon_gpa,
+        .length = end_gpa - anon_gpa,
+        .prot = prot,
+        .file_offset = -1,
+    };
+
+    /* Read whatever file data is not mapped */
+    gpa_t copy_gpa = (anon_gpa > phdr->p_vaddr ? anon_gpa : phdr->p_vaddr);
+    if (file_end_gpa > copy_gpa) {
+        seg->data_offset = copy_gpa - anon_gpa;
+        seg->data_size = file_end_gpa - copy_gpa;
+        seg->data = ivee_alloc(seg->data_size);
+        if (!seg->data) {
+            return -ENOMEM;
+        }
+
+        ssize_t res = pread(img->fd, seg->data, seg->data_size, phdr->p_offset + (copy_gpa - phdr->p_vaddr));
+        if (res != seg->data_size) {
+            return (res < 0 ? -errno : -EIO);
+        }
+    }
+
+    return 0;
+}
+
+static int compare_segments(const void* a, const void* b)
+{
+    const struct ivee_image_segment* sa = a;
+    const struct ivee_image_segment* sb = b;
+    return (sa->gpa > sb->gpa) - (sa->gpa < sb->gpa);
+}
+
+static int parse_elf64(struct ivee_image* img)
+{
+    int res = 0;
+
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+        return -ENOTSUP;
+    }
+
+    /* We only need headers, let libelf mmap the file instead of reading it */
+    Elf* elf = elf_begin(img->fd, ELF_C_READ_MMAP, NULL);
+    if (!elf) {
+        return -elf_errno();
+    }
+
+    if (elf_kind(elf) != ELF_K_ELF) {
+        res = -elf_errno();
+        goto out;
+    }
+
+    /*
+     * Accepted ELF type: ELF64 executable or dso
+     */
+
+    GElf_Ehdr ehdr;
+    if (!gelf_getehdr(elf, &ehdr)) {
+        res = -elf_errno();
+        goto out;
+    }
+
+    if (gelf_getclass(elf) != ELFCLASS64) {
+        res = -ENOTSUP;
+        goto out;
+    }
+
+    if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) {
+        res = -ENOTSUP;
+        goto out;
+    }
+
+    if (ehdr.e_machine != EM_X86_64) {
+        res = -ENOTSUP;
+        goto out;
+    }
+
+    /* Each segment gives at most a file mapping and an anonymous region */
+    img->segments = ivee_zalloc(2 * ehdr.e_phnum * sizeof(*img->segments));
+    if (!img->segments && ehdr.e_phnum > 0) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    for (size_t i = 0; i < ehdr.e_phnum; ++i ) {
+        GElf_Phdr phdr;
+
+        if (gelf_getphdr(elf, i, &phdr) != &phdr) {
+            res = -elf_errno();
+            goto out;
+        }
+
+        if (phdr.p_type != PT_LOAD) {
+            continue;
+        }
+
+        res = parse_elf64_segment(img, &phdr);
+        if (res != 0) {
+            goto out;
+        }
+    }
+
+    qsort(img->segments, img->nsegments, sizeof(*img->segments), compare_segments);
+
+    /* Overlapping segments would fail to map much later, catch them here */
+    for (size_t i = 1; i < img->nsegments; ++i) {
+        if (img->segments[i - 1].gpa + img->segments[i - 1].length > img->segments[i].gpa) {
+            res = -EINVAL;
+            goto out;
+        }
+    }
+
+    img->entry_addr = ehdr.e_entry;
+
+out:
+    elf_end(elf);
+    return res;
+}
+
+/* Forget parsed image layout, leaving the file open */
+static void reset_image_layout(struct ivee_image* img)
+{
+    for (size_t i = 0; i < img->nsegments; ++i) {
+        ivee_free(img->segments[i].data);
+    }
+
+    ivee_free(img->segments);
+    img->segments = NULL;
+    img->nsegments = 0;
+    img->entry_addr = 0;
+}
+
+int ivee_image_open(const char* file, enum ivee_executable_format format, struct ivee_image** out_img)
+{
+    int res = 0;
+
+    if (!file || !out_img) {
+        return -EINVAL;
+    }
+
+    /* We must have read and execute access for the file */
+    if (0 != access(file, R_OK | X_OK)) {
+        return -EINVAL;
+    }
+
+    struct ivee_image* img = ivee_zalloc(sizeof(*img));
+    if (!img) {
+        return -ENOMEM;
+    }
+
+    img->fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (img->fd < 0) {
+        res = -errno;
+        ivee_free(img);
+        return res;
+    }
+
+    switch (format) {
+    case IVEE_EXEC_BIN:
+        res = parse_bin(img);
+        break;
+    case IVEE_EXEC_ELF64:
+        res = parse_elf64(img);
+        break;
+    case IVEE_EXEC_ANY:
+        res = parse_elf64(img);
+        if (res != 0) {
+            reset_image_layout(img);
+            res = parse_bin(img);
+        }
+        break;
+    default:
+        res = -ENOTSUP;
+    };
+
+    if (res != 0) {
+        ivee_image_close(img);
+        return res;
+    }
+
+    *out_img = img;
+    return 0;
+}
+
+void ivee_image_close(struct ivee_image* img)
+{
+    if (!img) {
+        return;
+    }
+
+    reset_image_layout(img);
+    close(img->fd);
+    ivee_free(img);
+}
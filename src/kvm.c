@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <linux/kvm.h>
@@ -14,10 +15,12 @@
 #include "platform.h"
 #include "memory.h"
 #include "x86.h"
+#include "xsave.h"
 #include "kvm.h"
 
 #define MIN_KVM_VERSION 12
-#define MAX_KVM_MEMORY_SLOTS 16
+#define MIN_KVM_MEMORY_SLOTS 8
+#define MAX_KVM_CPUID_ENTRIES 1024
 
 /**
  * KVM memory slot tracking
@@ -33,6 +36,9 @@ struct ivee_kvm_memory_slot
     /* Is slot readonly? */
     bool is_ro;
 
+    /* Are guest writes logged? */
+    bool log_dirty;
+
     /* GPA start */
     gpa_t first_gpa;
 
@@ -41,6 +47,13 @@ struct ivee_kvm_memory_slot
 
     /* Mapped host virtual address */
     uintptr_t hva;
+
+    /*
+     * Slot pages KVM reported dirty which were not yet claimed by their regions,
+     * followed by the same size of scratch space for KVM_GET_DIRTY_LOG.
+     * Only allocated for logged slots that cover several regions.
+     */
+    uint64_t* dirty_bitmap;
 };
 
 /**
@@ -60,12 +73,38 @@ struct ivee_kvm_vm
     /* Mapped KVM vcpu data */
     struct kvm_run* kvm_run;
 
-    /* Memory slot array */
-    struct ivee_kvm_memory_slot memory_slots[MAX_KVM_MEMORY_SLOTS];
+    /* Mask of KVM_SYNC_X86_* register sets exchanged through kvm_run instead of ioctls */
+    uint64_t sync_regs;
+
+    /* Memory slot array, grows as needed up to the KVM limit */
+    struct ivee_kvm_memory_slot* memory_slots;
+    size_t nr_memory_slots;
+
+    /* XSAVE area buffer, allocated on first use */
+    void* xsave;
+    size_t xsave_size;
 };
 
 static struct ivee_kvm_info {
     int devfd;
+
+    /* Mask of KVM_SYNC_X86_* register sets supported by KVM_CAP_SYNC_REGS */
+    uint64_t sync_regs;
+
+    /* Guest CPUID, all vcpus get the same one */
+    struct kvm_cpuid2* cpuid;
+
+    /* Guest XCR0, 0 if guest has no XSAVE */
+    uint64_t xcr0;
+
+    /* Mask of enum ivee_cpu_features guest can use */
+    uint64_t cpu_features;
+
+    /* Guest MAXPHYADDR */
+    unsigned phys_bits;
+
+    /* Number of memory slots KVM allows per VM */
+    size_t nr_memslots;
 } g_kvm = {
     .devfd = -1,
 };
@@ -85,6 +124,138 @@ static inline int kvm_ioctl_noargs(int fd, unsigned long request)
     return kvm_ioctl(fd, request, 0);
 }
 
+enum { CPUID_EAX, CPUID_EBX, CPUID_ECX, CPUID_EDX };
+
+static struct kvm_cpuid_entry2* find_cpuid_entry(struct kvm_cpuid2* cpuid, uint32_t function, uint32_t index)
+{
+    for (uint32_t i = 0; i < cpuid->nent; ++i) {
+        struct kvm_cpuid_entry2* entry = &cpuid->entries[i];
+        if (entry->function == function &&
+            (entry->index == index || !(entry->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Read a CPUID bit the way guest will see it */
+static bool cpuid_bit(struct kvm_cpuid2* cpuid, uint32_t function, uint32_t index, int reg, unsigned bit)
+{
+    struct kvm_cpuid_entry2* entry = find_cpuid_entry(cpuid, function, index);
+    if (!entry) {
+        return false;
+    }
+
+    uint32_t regs[] = { entry->eax, entry->ebx, entry->ecx, entry->edx };
+    return regs[reg] & (1u << bit);
+}
+
+/* XCR0 state components needed for AVX and AVX-512 */
+#define YMM_STATE (X86_XFEATURE_MASK(X86_XFEATURE_SSE) | X86_XFEATURE_MASK(X86_XFEATURE_YMM))
+#define ZMM_STATE (YMM_STATE | X86_XFEATURE_MASK(X86_XFEATURE_OPMASK) | \
+                   X86_XFEATURE_MASK(X86_XFEATURE_ZMM_HI256) | X86_XFEATURE_MASK(X86_XFEATURE_HI16_ZMM))
+
+/* Guest CPUID bits behind enum ivee_cpu_features */
+static const struct {
+    uint64_t feature;
+    uint32_t function;
+    uint32_t index;
+    int reg;
+    unsigned bit;
+
+    /* XCR0 state components feature needs to be usable */
+    uint64_t xcr0;
+} g_cpu_feature_bits[] = {
+    { IVEE_CPU_SSE3,        0x1,        0, CPUID_ECX, 0,  0 },
+    { IVEE_CPU_PCLMULQDQ,   0x1,        0, CPUID_ECX, 1,  0 },
+    { IVEE_CPU_SSSE3,       0x1,        0, CPUID_ECX, 9,  0 },
+    { IVEE_CPU_FMA,         0x1,        0, CPUID_ECX, 12, YMM_STATE },
+    { IVEE_CPU_SSE4_1,      0x1,        0, CPUID_ECX, 19, 0 },
+    { IVEE_CPU_SSE4_2,      0x1,        0, CPUID_ECX, 20, 0 },
+    { IVEE_CPU_POPCNT,      0x1,        0, CPUID_ECX, 23, 0 },
+    { IVEE_CPU_AES,         0x1,        0, CPUID_ECX, 25, 0 },
+    { IVEE_CPU_XSAVE,       0x1,        0, CPUID_ECX, 26, 0 },
+    { IVEE_CPU_AVX,         0x1,        0, CPUID_ECX, 28, YMM_STATE },
+    { IVEE_CPU_F16C,        0x1,        0, CPUID_ECX, 29, YMM_STATE },
+    { IVEE_CPU_BMI1,        0x7,        0, CPUID_EBX, 3,  0 },
+    { IVEE_CPU_AVX2,        0x7,        0, CPUID_EBX, 5,  YMM_STATE },
+    { IVEE_CPU_BMI2,        0x7,        0, CPUID_EBX, 8,  0 },
+    { IVEE_CPU_AVX512F,     0x7,        0, CPUID_EBX, 16, ZMM_STATE },
+    { IVEE_CPU_AVX512DQ,    0x7,        0, CPUID_EBX, 17, ZMM_STATE },
+    { IVEE_CPU_AVX512CD,    0x7,        0, CPUID_EBX, 28, ZMM_STATE },
+    { IVEE_CPU_AVX512BW,    0x7,        0, CPUID_EBX, 30, ZMM_STATE },
+    { IVEE_CPU_AVX512VL,    0x7,        0, CPUID_EBX, 31, ZMM_STATE },
+    { IVEE_CPU_AVX512VNNI,  0x7,        0, CPUID_ECX, 11, ZMM_STATE },
+    { IVEE_CPU_PDPE1GB,     0x80000001, 0, CPUID_EDX, 26, 0 },
+};
+
+/*
+ * Get CPUID KVM can virtualize on this host and decide what guest XCR0 will be.
+ * We give guests everything that is supported, vectorized payloads dispatch on CPUID themselves.
+ */
+static int init_guest_cpuid(void)
+{
+    struct kvm_cpuid2* cpuid = NULL;
+    int res = -E2BIG;
+
+    for (uint32_t nent = 64; res == -E2BIG && nent <= MAX_KVM_CPUID_ENTRIES; nent *= 2) {
+        ivee_free(cpuid);
+        cpuid = ivee_zalloc(sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]));
+        if (!cpuid) {
+            return -ENOMEM;
+        }
+
+        cpuid->nent = nent;
+        res = kvm_ioctl(g_kvm.devfd, KVM_GET_SUPPORTED_CPUID, (uintptr_t)cpuid);
+    }
+
+    if (res < 0) {
+        ivee_free(cpuid);
+        return res;
+    }
+
+    /*
+     * Only enable state components we know how to handle in XCR0.
+     * AVX-512 components can only be enabled all together and on top of AVX.
+     */
+    uint64_t xcr0 = 0;
+    struct kvm_cpuid_entry2* entry = find_cpuid_entry(cpuid, 0xD, 0);
+    if (entry && cpuid_bit(cpuid, 0x1, 0, CPUID_ECX, 26)) {
+        uint64_t supported = ((uint64_t)entry->edx << 32) | entry->eax;
+        xcr0 = X86_XFEATURE_MASK(X86_XFEATURE_FP) | X86_XFEATURE_MASK(X86_XFEATURE_SSE);
+        if ((supported & YMM_STATE) == YMM_STATE) {
+            xcr0 |= YMM_STATE;
+            if ((supported & ZMM_STATE) == ZMM_STATE) {
+                xcr0 |= ZMM_STATE;
+            }
+        }
+    }
+
+    uint64_t features = 0;
+    for (size_t i = 0; i < sizeof(g_cpu_feature_bits) / sizeof(g_cpu_feature_bits[0]); ++i) {
+        if (cpuid_bit(cpuid, g_cpu_feature_bits[i].function, g_cpu_feature_bits[i].index,
+                      g_cpu_feature_bits[i].reg, g_cpu_feature_bits[i].bit) &&
+            (xcr0 & g_cpu_feature_bits[i].xcr0) == g_cpu_feature_bits[i].xcr0) {
+            features |= g_cpu_feature_bits[i].feature;
+        }
+    }
+
+    /* Without the leaf KVM assumes 36 bits */
+    entry = find_cpuid_entry(cpuid, 0x80000008, 0);
+    g_kvm.phys_bits = (entry && (entry->eax & 0xFF) ? (entry->eax & 0xFF) : 36);
+
+    g_kvm.cpuid = cpuid;
+    g_kvm.xcr0 = xcr0;
+    g_kvm.cpu_features = features;
+    return 0;
+}
+
+static void kick_signal_handler(int sig)
+{
+    /* Nothing to do, interrupting KVM_RUN is all we need */
+}
+
 int ivee_init_kvm(void)
 {
     int res = 0;
@@ -123,15 +294,41 @@ int ivee_init_kvm(void)
         return res;
     }
 
-    if (res < MAX_KVM_MEMORY_SLOTS) {
+    if (res < MIN_KVM_MEMORY_SLOTS) {
         return -ENOSPC;
     }
 
+    g_kvm.nr_memslots = res;
+
+    /* Optional: without sync regs we fall back to GET/SET ioctls */
+    res = kvm_ioctl(g_kvm.devfd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+    g_kvm.sync_regs = (res > 0 ? res : 0);
+
+    res = init_guest_cpuid();
+    if (res != 0) {
+        return res;
+    }
+
+    /* Kick signal only has to interrupt KVM_RUN, but default action would kill us and ignored signals are dropped */
+    struct sigaction sa;
+    if (sigaction(IVEE_KICK_SIGNAL, NULL, &sa) != 0) {
+        return -errno;
+    }
+
+    if (sa.sa_handler == SIG_DFL || sa.sa_handler == SIG_IGN) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = kick_signal_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(IVEE_KICK_SIGNAL, &sa, NULL) != 0) {
+            return -errno;
+        }
+    }
+
     return 0;
 }
 
 /* Set default signal mask for KVM_RUN:
- * everything is blocked besides SIGUSR1 */
+ * everything is blocked besides IVEE_KICK_SIGNAL */
 static int set_default_signal_mask(struct ivee_kvm_vm* vm)
 {
     int res = 0;
@@ -142,7 +339,7 @@ static int set_default_signal_mask(struct ivee_kvm_vm* vm)
        return res;
     }
 
-    res = sigdelset(&sigset, SIGUSR1);
+    res = sigdelset(&sigset, IVEE_KICK_SIGNAL);
     if (res != 0) {
        return res;
     }
@@ -158,6 +355,26 @@ static int set_default_signal_mask(struct ivee_kvm_vm* vm)
     return kvm_ioctl(vm->vcpu_fd, KVM_SET_SIGNAL_MASK, (uintptr_t)&data.sigmask);
 }
 
+/* Give vcpu our guest CPUID and enable its extended state components */
+static int set_guest_cpu(struct ivee_kvm_vm* vm)
+{
+    int res = kvm_ioctl(vm->vcpu_fd, KVM_SET_CPUID2, (uintptr_t)g_kvm.cpuid);
+    if (res != 0) {
+        return res;
+    }
+
+    if (!g_kvm.xcr0) {
+        return 0;
+    }
+
+    struct kvm_xcrs xcrs = {
+        .nr_xcrs = 1,
+        .xcrs[0] = { .xcr = 0, .value = g_kvm.xcr0 },
+    };
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_XCRS, (uintptr_t)&xcrs);
+}
+
 struct ivee_kvm_vm* ivee_create_kvm_vm(void)
 {
     struct ivee_kvm_vm* vm = ivee_zalloc(sizeof(*vm));
@@ -192,9 +409,17 @@ struct ivee_kvm_vm* ivee_create_kvm_vm(void)
         goto error_out;
     }
 
-    for (size_t i = 0; i < MAX_KVM_MEMORY_SLOTS; ++i) {
-        struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
-        slot->index = i;
+    if (set_guest_cpu(vm) != 0) {
+        goto error_out;
+    }
+
+    /*
+     * Have KVM_RUN pass GPRs in and out through kvm_run sync area if we can.
+     * Sregs are only synced on demand by marking them dirty: we almost never need them back.
+     */
+    vm->sync_regs = g_kvm.sync_regs & (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS);
+    if (vm->sync_regs & KVM_SYNC_X86_REGS) {
+        vm->kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS;
     }
 
     return vm;
@@ -216,6 +441,14 @@ void ivee_release_kvm_vm(struct ivee_kvm_vm* vm)
         munmap(vm->kvm_run, vm->vcpu_mapping_size);
     }
 
+    ivee_free(vm->xsave);
+
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        ivee_free(vm->memory_slots[i].dirty_bitmap);
+    }
+
+    ivee_free(vm->memory_slots);
+
     if (vm->vcpu_fd >= 0) {
         close(vm->vcpu_fd);
     }
@@ -231,7 +464,7 @@ static int set_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot*
 {
     struct kvm_userspace_memory_region memregion;
     memregion.slot = slot->index;
-    memregion.flags = slot->is_ro ? KVM_MEM_READONLY : 0;
+    memregion.flags = (slot->is_ro ? KVM_MEM_READONLY : 0) | (slot->log_dirty ? KVM_MEM_LOG_DIRTY_PAGES : 0);
     memregion.guest_phys_addr = slot->first_gpa;
     memregion.memory_size = slot->last_gpa - slot->first_gpa + 1;
     memregion.userspace_addr = slot->hva;
@@ -241,63 +474,291 @@ static int set_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot*
 
 static int delete_memory_slot(struct ivee_kvm_vm* vm, struct ivee_kvm_memory_slot* slot)
 {
-    struct kvm_userspace_memory_region memregion;
+    struct kvm_userspace_memory_region memregion = {0};
     memregion.slot = slot->index;
     memregion.memory_size = 0;
 
     return kvm_ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, (uintptr_t)&memregion);
 }
 
+/*
+ * Contiguous GPA range KVM should map with a single slot.
+ * Adjacent regions share a slot when their host memory is contiguous as well
+ * and KVM would treat them the same way.
+ */
+struct slot_span
+{
+    gpa_t first_gpa;
+    gpa_t last_gpa;
+    uintptr_t hva;
+    bool is_ro;
+    bool log_dirty;
+
+    /* Span already has a slot */
+    bool has_slot;
+};
+
+/* Turn memory map into a list of coalesced slot spans sorted by GPA */
+static int make_slot_spans(const struct ivee_memory_map* memmap, struct slot_span** out_spans, size_t* out_count)
+{
+    *out_spans = NULL;
+    *out_count = 0;
+    if (memmap->nregions == 0) {
+        return 0;
+    }
+
+    struct slot_span* spans = ivee_alloc(memmap->nregions * sizeof(*spans));
+    if (!spans) {
+        return -ENOMEM;
+    }
+
+    /* Regions are already sorted, so neighbours are next to each other */
+    size_t count = 0;
+    struct ivee_guest_memory_region* r;
+    IVEE_MEMORY_MAP_FOREACH(r, memmap) {
+        struct slot_span span = {
+            .first_gpa = r->first_gfn << X86_PAGE_SHIFT,
+            .last_gpa = ((r->last_gfn + 1) << X86_PAGE_SHIFT) - 1,
+            .hva = (uintptr_t)r->hva,
+            .is_ro = (r->prot & IVEE_WRITE) == 0, /* KVM does not have a non-executable flag */
+        };
+        span.log_dirty = r->log_dirty && !span.is_ro;
+
+        struct slot_span* prev = (count ? &spans[count - 1] : NULL);
+        if (prev &&
+            prev->last_gpa + 1 == span.first_gpa &&
+            prev->hva + (prev->last_gpa - prev->first_gpa + 1) == span.hva &&
+            prev->is_ro == span.is_ro &&
+            prev->log_dirty == span.log_dirty) {
+            prev->last_gpa = span.last_gpa;
+        } else {
+            spans[count++] = span;
+        }
+    }
+
+    *out_spans = spans;
+    *out_count = count;
+    return 0;
+}
+
+static bool slot_maps_span(const struct ivee_kvm_memory_slot* slot, const struct slot_span* span)
+{
+    return slot->first_gpa == span->first_gpa &&
+           slot->last_gpa == span->last_gpa &&
+           slot->hva == span->hva &&
+           slot->is_ro == span->is_ro;
+}
+
+/* Get an unused slot, growing slot array if all are taken */
+static struct ivee_kvm_memory_slot* alloc_memory_slot(struct ivee_kvm_vm* vm)
+{
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        if (!vm->memory_slots[i].is_used) {
+            return vm->memory_slots + i;
+        }
+    }
+
+    if (vm->nr_memory_slots == g_kvm.nr_memslots) {
+        return NULL;
+    }
+
+    size_t count = (vm->nr_memory_slots ? vm->nr_memory_slots * 2 : MIN_KVM_MEMORY_SLOTS);
+    if (count > g_kvm.nr_memslots) {
+        count = g_kvm.nr_memslots;
+    }
+
+    struct ivee_kvm_memory_slot* slots = ivee_realloc(vm->memory_slots, count * sizeof(*slots));
+    if (!slots) {
+        return NULL;
+    }
+
+    memset(slots + vm->nr_memory_slots, 0, (count - vm->nr_memory_slots) * sizeof(*slots));
+    for (size_t i = vm->nr_memory_slots; i < count; ++i) {
+        slots[i].index = i;
+    }
+
+    struct ivee_kvm_memory_slot* slot = slots + vm->nr_memory_slots;
+    vm->memory_slots = slots;
+    vm->nr_memory_slots = count;
+    return slot;
+}
+
 int ivee_set_kvm_memory_map(struct ivee_kvm_vm* vm, const struct ivee_memory_map* memmap)
 {
+    int res = 0;
+
     if (!vm || !memmap) {
         return -EINVAL;
     }
 
+    struct slot_span* spans = NULL;
+    size_t nspans = 0;
+    res = make_slot_spans(memmap, &spans, &nspans);
+    if (res != 0) {
+        return res;
+    }
+
     /*
-     * Blindly resetting slot contents is expensive in KVM, however we don't expect memory map to change
-     * often (or at all) for our cases, so we will just reconstruct slots entirely from each new memory map.
-     *
-     * If frequency of memmap updates ever changes this could become a problem.
+     * Every slot change makes KVM rebuild its memslot array and zap EPT entries,
+     * so only touch slots that differ from the new memory map.
+     * Removed slots go first, so that new spans can take their GPA ranges.
      */
-
-    for (size_t i = 0; i < MAX_KVM_MEMORY_SLOTS; ++i) {
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
         struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
         if (!slot->is_used) {
             continue;
         }
 
-        int res = delete_memory_slot(vm, slot);
+        struct slot_span* span = NULL;
+        for (size_t j = 0; j < nspans; ++j) {
+            if (slot_maps_span(slot, &spans[j])) {
+                span = &spans[j];
+                break;
+            }
+        }
+
+        if (!span) {
+            res = delete_memory_slot(vm, slot);
+            if (res != 0) {
+                goto out;
+            }
+
+            slot->is_used = false;
+            ivee_free(slot->dirty_bitmap);
+            slot->dirty_bitmap = NULL;
+            continue;
+        }
+
+        span->has_slot = true;
+
+        /* Dirty logging can be toggled on a live slot, KVM starts a fresh log */
+        if (slot->log_dirty != span->log_dirty) {
+            slot->log_dirty = span->log_dirty;
+            ivee_free(slot->dirty_bitmap);
+            slot->dirty_bitmap = NULL;
+
+            res = set_memory_slot(vm, slot);
+            if (res != 0) {
+                goto out;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nspans; ++i) {
+        const struct slot_span* span = &spans[i];
+        if (span->has_slot) {
+            continue;
+        }
+
+        struct ivee_kvm_memory_slot* slot = alloc_memory_slot(vm);
+        if (!slot) {
+            res = -ENOSPC;
+            goto out;
+        }
+
+        slot->first_gpa = span->first_gpa;
+        slot->last_gpa = span->last_gpa;
+        slot->is_ro = span->is_ro;
+        slot->log_dirty = span->log_dirty;
+        slot->hva = span->hva;
+
+        res = set_memory_slot(vm, slot);
         if (res != 0) {
-            return res;
+            goto out;
         }
 
-        slot->is_used = false;
+        slot->is_used = true;
     }
 
-    size_t index = 0;
-    struct ivee_guest_memory_region* r;
-    LIST_FOREACH(r, &memmap->regions, link) {
-        if (index == MAX_KVM_MEMORY_SLOTS) {
-            return -ENOSPC;
+out:
+    ivee_free(spans);
+    return res;
+}
+
+/* Move count bits starting at first out of src into dst, bit 0 of dst being the first one */
+static void take_bits(uint64_t* src, size_t first, size_t count, uint64_t* dst)
+{
+    for (size_t i = 0; i < (count + 63) / 64; ++i) {
+        size_t n = (count - i * 64 < 64 ? count - i * 64 : 64);
+        uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1);
+        size_t word = (first + i * 64) / 64;
+        size_t shift = (first + i * 64) % 64;
+
+        uint64_t bits = src[word] >> shift;
+        src[word] &= ~(mask << shift);
+        if (shift + n > 64) {
+            bits |= src[word + 1] << (64 - shift);
+            src[word + 1] &= ~(mask >> (64 - shift));
         }
 
-        struct ivee_kvm_memory_slot* slot = vm->memory_slots + index;
-        slot->first_gpa = r->first_gfn << 12;
-        slot->last_gpa = ((r->last_gfn + 1) << 12) - 1;
-        slot->is_ro = (r->prot & IVEE_WRITE) == 0; /* KVM does not have a non-executable flag */
-        slot->hva = (uintptr_t)r->hva;
+        dst[i] = bits & mask;
+    }
+}
+
+int ivee_kvm_get_dirty_log(struct ivee_kvm_vm* vm, const struct ivee_guest_memory_region* mr, uint64_t* bitmap)
+{
+    if (!vm || !mr || !bitmap) {
+        return -EINVAL;
+    }
+
+    gpa_t first_gpa = mr->first_gfn << X86_PAGE_SHIFT;
+    gpa_t last_gpa = ((mr->last_gfn + 1) << X86_PAGE_SHIFT) - 1;
+    for (size_t i = 0; i < vm->nr_memory_slots; ++i) {
+        struct ivee_kvm_memory_slot* slot = vm->memory_slots + i;
+        if (!slot->is_used || first_gpa < slot->first_gpa || first_gpa > slot->last_gpa) {
+            continue;
+        }
+
+        if (!slot->log_dirty || last_gpa > slot->last_gpa) {
+            return -EINVAL;
+        }
+
+        /* Region has the slot to itself, let KVM write the log directly */
+        if (first_gpa == slot->first_gpa && last_gpa == slot->last_gpa) {
+            struct kvm_dirty_log log = {
+                .slot = slot->index,
+                .dirty_bitmap = bitmap,
+            };
+
+            return kvm_ioctl(vm->fd, KVM_GET_DIRTY_LOG, (uintptr_t)&log);
+        }
 
-        int res = set_memory_slot(vm, slot);
+        /*
+         * Getting the log clears it for the whole slot,
+         * so keep what belongs to other regions until they ask for it.
+         */
+        size_t npages = (slot->last_gpa - slot->first_gpa + 1) >> X86_PAGE_SHIFT;
+        size_t nwords = (npages + 63) / 64;
+        if (!slot->dirty_bitmap) {
+            slot->dirty_bitmap = ivee_zalloc(2 * nwords * sizeof(uint64_t));
+            if (!slot->dirty_bitmap) {
+                return -ENOMEM;
+            }
+        }
+
+        uint64_t* scratch = slot->dirty_bitmap + nwords;
+        struct kvm_dirty_log log = {
+            .slot = slot->index,
+            .dirty_bitmap = scratch,
+        };
+
+        int res = kvm_ioctl(vm->fd, KVM_GET_DIRTY_LOG, (uintptr_t)&log);
         if (res != 0) {
             return res;
         }
 
-        slot->is_used = true;
-        ++index;
+        for (size_t j = 0; j < nwords; ++j) {
+            slot->dirty_bitmap[j] |= scratch[j];
+        }
+
+        take_bits(slot->dirty_bitmap,
+                  (first_gpa - slot->first_gpa) >> X86_PAGE_SHIFT,
+                  mr->last_gfn - mr->first_gfn + 1,
+                  bitmap);
+        return 0;
     }
 
-    return 0;
+    return -ENOENT;
 }
 
 static void load_segment(struct kvm_segment* kvmseg, const struct x86_segment* seg)
@@ -338,91 +799,143 @@ static void load_dtable(struct kvm_dtable* kvm_dtable, const struct x86_dtbl* dt
     memset(kvm_dtable->padding, 0, sizeof(kvm_dtable->padding));
 }
 
-/* Load effective cpu state into KVM vcpu */
-static int load_vcpu_state(struct ivee_kvm_vm* vm, const struct x86_cpu_state* x86_cpu)
+static int load_regs(struct ivee_kvm_vm* vm, const struct x86_cpu_state* x86_cpu)
+{
+    struct kvm_regs kvm_regs;
+    struct kvm_regs* pregs = (vm->sync_regs & KVM_SYNC_X86_REGS ? &vm->kvm_run->s.regs.regs : &kvm_regs);
+
+    pregs->rax = x86_cpu->rax;
+    pregs->rbx = x86_cpu->rbx;
+    pregs->rcx = x86_cpu->rcx;
+    pregs->rdx = x86_cpu->rdx;
+    pregs->rsi = x86_cpu->rsi;
+    pregs->rdi = x86_cpu->rdi;
+    pregs->rsp = x86_cpu->rsp;
+    pregs->rbp = x86_cpu->rbp;
+    pregs->r8 = x86_cpu->r8;
+    pregs->r9 = x86_cpu->r9;
+    pregs->r10 = x86_cpu->r10;
+    pregs->r11 = x86_cpu->r11;
+    pregs->r12 = x86_cpu->r12;
+    pregs->r13 = x86_cpu->r13;
+    pregs->r14 = x86_cpu->r14;
+    pregs->r15 = x86_cpu->r15;
+    pregs->rip = x86_cpu->rip;
+    pregs->rflags = x86_cpu->rflags;
+
+    if (pregs != &kvm_regs) {
+        /* Picked up by next KVM_RUN */
+        vm->kvm_run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+        return 0;
+    }
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_REGS, (uintptr_t)&kvm_regs);
+}
+
+static int load_sregs(struct ivee_kvm_vm* vm, const struct x86_cpu_state* x86_cpu)
+{
+    struct kvm_sregs kvm_sregs;
+    struct kvm_sregs* psregs = (vm->sync_regs & KVM_SYNC_X86_SREGS ? &vm->kvm_run->s.regs.sregs : &kvm_sregs);
+
+    memset(psregs, 0, sizeof(*psregs));
+    load_segment(&psregs->cs, &x86_cpu->cs);
+    load_segment(&psregs->ds, &x86_cpu->ds);
+    load_segment(&psregs->es, &x86_cpu->es);
+    load_segment(&psregs->fs, &x86_cpu->fs);
+    load_segment(&psregs->gs, &x86_cpu->gs);
+    load_segment(&psregs->ss, &x86_cpu->ss);
+    load_segment(&psregs->tr, &x86_cpu->tr);
+    load_segment(&psregs->ldt, &x86_cpu->ldt);
+    load_dtable(&psregs->gdt, &x86_cpu->gdt);
+    load_dtable(&psregs->idt, &x86_cpu->idt);
+    psregs->cr0 = x86_cpu->cr0;
+    psregs->cr2 = x86_cpu->cr2;
+    psregs->cr3 = x86_cpu->cr3;
+    psregs->cr4 = x86_cpu->cr4;
+    psregs->efer = x86_cpu->efer;
+    psregs->apic_base = x86_cpu->apic_base;
+
+    if (psregs != &kvm_sregs) {
+        vm->kvm_run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+        return 0;
+    }
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_SREGS, (uintptr_t)&kvm_sregs);
+}
+
+/*
+ * Load effective cpu state into KVM vcpu.
+ *
+ * Only parts we have changed since the last load are pushed.
+ * Segments and control registers are set up once and then stay the same between calls,
+ * so in steady state this is a single KVM_SET_REGS.
+ */
+static int load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
 {
     int res = 0;
 
-    struct kvm_regs kvm_regs;
-    kvm_regs.rax = x86_cpu->rax;
-    kvm_regs.rbx = x86_cpu->rbx;
-    kvm_regs.rcx = x86_cpu->rcx;
-    kvm_regs.rdx = x86_cpu->rdx;
-    kvm_regs.rsi = x86_cpu->rsi;
-    kvm_regs.rdi = x86_cpu->rdi;
-    kvm_regs.rsp = x86_cpu->rsp;
-    kvm_regs.rbp = x86_cpu->rbp;
-    kvm_regs.r8 = x86_cpu->r8;
-    kvm_regs.r9 = x86_cpu->r9;
-    kvm_regs.r10 = x86_cpu->r10;
-    kvm_regs.r11 = x86_cpu->r11;
-    kvm_regs.r12 = x86_cpu->r12;
-    kvm_regs.r13 = x86_cpu->r13;
-    kvm_regs.r14 = x86_cpu->r14;
-    kvm_regs.r15 = x86_cpu->r15;
-    kvm_regs.rip = x86_cpu->rip;
-    kvm_regs.rflags = x86_cpu->rflags;
-
-    res = kvm_ioctl(vm->vcpu_fd, KVM_SET_REGS, (uintptr_t)&kvm_regs);
-    if (res != 0) {
-        return res;
+    if (x86_cpu->dirty & X86_CPU_STATE_REGS) {
+        res = load_regs(vm, x86_cpu);
+        if (res != 0) {
+            return res;
+        }
+
+        x86_cpu->dirty &= ~X86_CPU_STATE_REGS;
     }
 
-    struct kvm_sregs kvm_sregs = {0};
-    load_segment(&kvm_sregs.cs, &x86_cpu->cs);
-    load_segment(&kvm_sregs.ds, &x86_cpu->ds);
-    load_segment(&kvm_sregs.es, &x86_cpu->es);
-    load_segment(&kvm_sregs.fs, &x86_cpu->fs);
-    load_segment(&kvm_sregs.gs, &x86_cpu->gs);
-    load_segment(&kvm_sregs.ss, &x86_cpu->ss);
-    load_segment(&kvm_sregs.tr, &x86_cpu->tr);
-    load_segment(&kvm_sregs.ldt, &x86_cpu->ldt);
-    load_dtable(&kvm_sregs.gdt, &x86_cpu->gdt);
-    load_dtable(&kvm_sregs.idt, &x86_cpu->idt);
-    kvm_sregs.cr0 = x86_cpu->cr0;
-    kvm_sregs.cr2 = x86_cpu->cr2;
-    kvm_sregs.cr3 = x86_cpu->cr3;
-    kvm_sregs.cr4 = x86_cpu->cr4;
-    kvm_sregs.efer = x86_cpu->efer;
-    kvm_sregs.apic_base = x86_cpu->apic_base;
-
-    res = kvm_ioctl(vm->vcpu_fd, KVM_SET_SREGS, (uintptr_t)&kvm_sregs);
-    if (res != 0) {
-        return res;
+    if (x86_cpu->dirty & X86_CPU_STATE_SREGS) {
+        res = load_sregs(vm, x86_cpu);
+        if (res != 0) {
+            return res;
+        }
+
+        x86_cpu->dirty &= ~X86_CPU_STATE_SREGS;
     }
 
     return 0;
 }
 
-/* Store effective cpu state from KVM vcpu */
-__attribute__((unused)) static int store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+static int store_regs(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
 {
     int res = 0;
 
     struct kvm_regs kvm_regs;
-    res = kvm_ioctl(vm->vcpu_fd, KVM_GET_REGS, (uintptr_t)&kvm_regs);
-    if (res != 0) {
-        return res;
+    const struct kvm_regs* pregs = &kvm_regs;
+    if (vm->sync_regs & KVM_SYNC_X86_REGS) {
+        /* KVM_RUN has already put valid GPRs in sync area on exit */
+        pregs = &vm->kvm_run->s.regs.regs;
+    } else {
+        res = kvm_ioctl(vm->vcpu_fd, KVM_GET_REGS, (uintptr_t)&kvm_regs);
+        if (res != 0) {
+            return res;
+        }
     }
 
-    x86_cpu->rax = kvm_regs.rax;
-    x86_cpu->rbx = kvm_regs.rbx;
-    x86_cpu->rcx = kvm_regs.rcx;
-    x86_cpu->rdx = kvm_regs.rdx;
-    x86_cpu->rsi = kvm_regs.rsi;
-    x86_cpu->rdi = kvm_regs.rdi;
-    x86_cpu->rsp = kvm_regs.rsp;
-    x86_cpu->rbp = kvm_regs.rbp;
-    x86_cpu->r8 = kvm_regs.r8;
-    x86_cpu->r9 = kvm_regs.r9;
-    x86_cpu->r10 = kvm_regs.r10;
-    x86_cpu->r11 = kvm_regs.r11;
-    x86_cpu->r12 = kvm_regs.r12;
-    x86_cpu->r13 = kvm_regs.r13;
-    x86_cpu->r14 = kvm_regs.r14;
-    x86_cpu->r15 = kvm_regs.r15;
-    x86_cpu->rip = kvm_regs.rip;
-    x86_cpu->rflags = kvm_regs.rflags;
+    x86_cpu->rax = pregs->rax;
+    x86_cpu->rbx = pregs->rbx;
+    x86_cpu->rcx = pregs->rcx;
+    x86_cpu->rdx = pregs->rdx;
+    x86_cpu->rsi = pregs->rsi;
+    x86_cpu->rdi = pregs->rdi;
+    x86_cpu->rsp = pregs->rsp;
+    x86_cpu->rbp = pregs->rbp;
+    x86_cpu->r8 = pregs->r8;
+    x86_cpu->r9 = pregs->r9;
+    x86_cpu->r10 = pregs->r10;
+    x86_cpu->r11 = pregs->r11;
+    x86_cpu->r12 = pregs->r12;
+    x86_cpu->r13 = pregs->r13;
+    x86_cpu->r14 = pregs->r14;
+    x86_cpu->r15 = pregs->r15;
+    x86_cpu->rip = pregs->rip;
+    x86_cpu->rflags = pregs->rflags;
+
+    return 0;
+}
+
+static int store_sregs(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+{
+    int res = 0;
 
     struct kvm_sregs kvm_sregs = {0};
     res = kvm_ioctl(vm->vcpu_fd, KVM_GET_SREGS, (uintptr_t)&kvm_sregs);
@@ -447,22 +960,115 @@ __attribute__((unused)) static int store_vcpu_state(struct ivee_kvm_vm* vm, stru
     return 0;
 }
 
+/* Store effective cpu state from KVM vcpu */
+static int store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu, uint32_t parts)
+{
+    int res = 0;
+
+    if (parts & X86_CPU_STATE_REGS) {
+        res = store_regs(vm, x86_cpu);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    if (parts & X86_CPU_STATE_SREGS) {
+        res = store_sregs(vm, x86_cpu);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    /* Whatever we've just fetched is in sync with the vcpu */
+    x86_cpu->dirty &= ~parts;
+    return 0;
+}
+
 int ivee_kvm_load_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
 {
     return load_vcpu_state(vm, x86_cpu);
 }
 
-int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu)
+int ivee_kvm_store_vcpu_state(struct ivee_kvm_vm* vm, struct x86_cpu_state* x86_cpu, uint32_t parts)
 {
-    return store_vcpu_state(vm, x86_cpu);
+    return store_vcpu_state(vm, x86_cpu, parts);
+}
+
+void* ivee_kvm_xsave_area(struct ivee_kvm_vm* vm)
+{
+    if (vm->xsave) {
+        return vm->xsave;
+    }
+
+    /* XSAVE area may be larger than struct kvm_xsave if host has big state components like AMX */
+    int size = kvm_ioctl(vm->fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE2);
+    vm->xsave_size = (size > (int)sizeof(struct kvm_xsave) ? (size_t)size : sizeof(struct kvm_xsave));
+    vm->xsave = ivee_zalloc(vm->xsave_size);
+    return vm->xsave;
+}
+
+int ivee_kvm_load_xsave(struct ivee_kvm_vm* vm)
+{
+    return kvm_ioctl(vm->vcpu_fd, KVM_SET_XSAVE, (uintptr_t)vm->xsave);
+}
+
+int ivee_kvm_store_xsave(struct ivee_kvm_vm* vm)
+{
+    if (vm->xsave_size > sizeof(struct kvm_xsave)) {
+        return kvm_ioctl(vm->vcpu_fd, KVM_GET_XSAVE2, (uintptr_t)vm->xsave);
+    }
+
+    return kvm_ioctl(vm->vcpu_fd, KVM_GET_XSAVE, (uintptr_t)vm->xsave);
+}
+
+void ivee_kvm_request_exit(struct ivee_kvm_vm* vm)
+{
+    atomic_store_explicit((_Atomic uint8_t*)&vm->kvm_run->immediate_exit, 1, memory_order_release);
+}
+
+void ivee_kvm_clear_exit_request(struct ivee_kvm_vm* vm)
+{
+    atomic_store_explicit((_Atomic uint8_t*)&vm->kvm_run->immediate_exit, 0, memory_order_relaxed);
+}
+
+void ivee_kvm_complete_exit(struct ivee_kvm_vm* vm)
+{
+    /* Pending I/O is completed before immediate exit is checked */
+    ivee_kvm_request_exit(vm);
+    kvm_ioctl_noargs(vm->vcpu_fd, KVM_RUN);
+}
+
+uint64_t ivee_kvm_cpu_features(void)
+{
+    return g_kvm.cpu_features;
+}
+
+uint64_t ivee_kvm_guest_xcr0(void)
+{
+    return g_kvm.xcr0;
+}
+
+unsigned ivee_kvm_guest_phys_bits(void)
+{
+    return g_kvm.phys_bits;
+}
+
+int ivee_kvm_get_tsc_khz(struct ivee_kvm_vm* vm)
+{
+    return kvm_ioctl_noargs(vm->vcpu_fd, KVM_GET_TSC_KHZ);
 }
 
 int ivee_kvm_run(struct ivee_kvm_vm* vm, struct ivee_exit* exit)
 {
     int res = 0;
 
+    uint64_t start = ivee_rdtsc();
     res = kvm_ioctl_noargs(vm->vcpu_fd, KVM_RUN);
-    if (res != 0) {
+    exit->run_cycles = ivee_rdtsc() - start;
+    if (res == -EINTR) {
+        exit->exit_reason = IVEE_EXIT_INTERRUPTED;
+        return 0;
+    } else if (res != 0) {
         return res;
     }
 
@@ -477,6 +1083,10 @@ int ivee_kvm_run(struct ivee_kvm_vm* vm, struct ivee_exit* exit)
 
         return 0;
 
+    case KVM_EXIT_HLT:
+        exit->exit_reason = IVEE_EXIT_HLT;
+        return 0;
+
     default:
         exit->exit_reason = IVEE_EXIT_UNKNOWN;
         return 0;
@@ -1,65 +1,165 @@
 #include <errno.h>
-#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
-#include <gelf.h>
-
 #include "libivee/libivee.h"
 #include "platform.h"
 #include "memory.h"
+#include "image.h"
+#include "stats.h"
+#include "async.h"
+#include "timer.h"
+#include "service.h"
+#include "xsave.h"
 #include "x86.h"
 #include "kvm.h"
+#include "ivee.h"
 
-struct ivee {
-    /* Underlying KVM VM/VCPU */
-    struct ivee_kvm_vm* vm;
+uint64_t ivee_list_platform_capabilities(void)
+{
+    /* TODO: we don't support any caps yet */
+    return 0;
+}
 
-    /* Active memory map */
-    struct ivee_memory_map memory_map;
+uint64_t ivee_list_cpu_features(void)
+{
+    if (ivee_init_kvm() != 0) {
+        return 0;
+    }
 
-    /* x86 boot processor state */
-    struct x86_cpu_state x86_cpu;
+    return ivee_kvm_cpu_features();
+}
 
-    /* Loaded executable entry point */
-    uint64_t entry_addr;
+/*
+ * Guest physical memory defaults and limits.
+ * Page table pages are mapped in a reserve at the very end of guest memory.
+ * Registered buffers are mapped in a window right above guest memory.
+ */
+#define IVEE_DEFAULT_MEMORY_SIZE    (1ull << 30)
+#define IVEE_DEFAULT_BUFFER_WINDOW  (1ull << 30)
+#define IVEE_DEFAULT_STACK_SIZE     (64ull << 10)
+#define IVEE_PAGE_TABLE_RESERVE     (2ull << 20)
+#define IVEE_LAYOUT_ALIGN           (2ull << 20)
 
-    /* Region that maps guest page table pages */
-    struct ivee_guest_memory_region* gpt_mr;
+#define ALIGN_UP(x, a)      (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+#define IS_ALIGNED(x, a)    (((x) & ((uint64_t)(a) - 1)) == 0)
 
-    /* Flag set to true if guest requested termination */
-    bool should_terminate;
-};
+/* Guest memory is limited by MAXPHYADDR and by what our identity map can cover */
+static uint64_t max_memory_size(void)
+{
+    unsigned bits = ivee_kvm_guest_phys_bits();
+    return 1ull << (bits < X86_VA_BITS ? bits : X86_VA_BITS);
+}
 
-uint64_t ivee_list_platform_capabilities(void)
+static bool is_valid_memory_backing(enum ivee_memory_backing backing)
 {
-    /* TODO: we don't support any caps yet */
+    switch (backing) {
+    case IVEE_MEMORY_SHARED:
+    case IVEE_MEMORY_SHARED_THP:
+    case IVEE_MEMORY_PRIVATE_THP:
+    case IVEE_MEMORY_HUGETLB_2M:
+    case IVEE_MEMORY_HUGETLB_1G:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Check user configuration and fill in the defaults */
+static int resolve_config(const struct ivee_config* config, struct ivee_config* out)
+{
+    static const struct ivee_config defaults = { 0 };
+    if (!config) {
+        config = &defaults;
+    }
+
+    *out = *config;
+
+    if (out->memory_size == 0) {
+        out->memory_size = IVEE_DEFAULT_MEMORY_SIZE;
+    }
+
+    if (out->memory_size > max_memory_size()) {
+        return -EINVAL;
+    }
+
+    out->memory_size = ALIGN_UP(out->memory_size, IVEE_LAYOUT_ALIGN);
+    if (out->memory_size <= IVEE_PAGE_TABLE_RESERVE) {
+        return -EINVAL;
+    }
+
+    if (out->stack_size == 0) {
+        out->stack_size = IVEE_DEFAULT_STACK_SIZE;
+    }
+
+    out->stack_size = ALIGN_UP(out->stack_size, X86_PAGE_SIZE);
+
+    uint64_t usable_size = out->memory_size - IVEE_PAGE_TABLE_RESERVE;
+    if (out->stack_top == 0) {
+        out->stack_top = usable_size;
+    }
+
+    if (!IS_ALIGNED(out->stack_top, X86_PAGE_SIZE) ||
+        out->stack_top > usable_size ||
+        out->stack_top < out->stack_size) {
+        return -EINVAL;
+    }
+
+    out->heap_size = ALIGN_UP(out->heap_size, X86_PAGE_SIZE);
+    if (!IS_ALIGNED(out->heap_base, X86_PAGE_SIZE) || out->heap_size > usable_size) {
+        return -EINVAL;
+    }
+
+    /* Default window shrinks to fit, explicitly requested one has to fit as is */
+    uint64_t window_limit = max_memory_size() - out->memory_size;
+    if (out->buffer_window_size == 0) {
+        out->buffer_window_size = (IVEE_DEFAULT_BUFFER_WINDOW < window_limit ? IVEE_DEFAULT_BUFFER_WINDOW : window_limit);
+    }
+
+    out->buffer_window_size = ALIGN_UP(out->buffer_window_size, IVEE_LAYOUT_ALIGN);
+    if (out->buffer_window_size > window_limit) {
+        return -EINVAL;
+    }
+
+    if (!is_valid_memory_backing(out->memory_backing)) {
+        return -EINVAL;
+    }
+
     return 0;
 }
 
-int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
+int ivee_create_config(enum ivee_capabilities caps, const struct ivee_config* config, struct ivee** out_ivee_ptr)
 {
     if (!out_ivee_ptr) {
         return -EINVAL;
     }
 
+    /* Memory limits depend on guest CPU */
+    int res = ivee_init_kvm();
+    if (res != 0) {
+        return res;
+    }
+
+    struct ivee_config resolved_config;
+    res = resolve_config(config, &resolved_config);
+    if (res != 0) {
+        return res;
+    }
+
     if (caps & ~ivee_list_platform_capabilities()) {
         return -ENOTSUP;
     }
 
-    int res = 0;
-
     struct ivee* ivee = ivee_zalloc(sizeof(*ivee));
     if (!ivee) {
         return -ENOMEM;
     }
 
-    res = ivee_init_kvm();
-    if (res != 0) {
-        goto error_out;
-    }
+    ivee_stats_register(&ivee->stats);
+    pthread_mutex_init(&ivee->kick_lock, NULL);
 
     ivee->vm = ivee_create_kvm_vm();
     if (!ivee->vm) {
@@ -67,11 +167,18 @@ int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
         goto error_out;
     }
 
-    res = ivee_init_memory_map(&ivee->memory_map);
+    /* Stats are still useful if we can't convert cycles to time */
+    res = ivee_kvm_get_tsc_khz(ivee->vm);
+    ivee->stats.counters.tsc_khz = (res > 0 ? res : 0);
+
+    res = ivee_init_memory_map(&ivee->memory_map, resolved_config.memory_size);
     if (res != 0) {
         goto error_out;
     }
 
+    ivee->caps = caps;
+    ivee->config = resolved_config;
+    ivee->memory_backing = resolved_config.memory_backing;
     *out_ivee_ptr = ivee;
     return 0;
 
@@ -80,85 +187,287 @@ error_out:
     return res;
 }
 
+int ivee_create(enum ivee_capabilities caps, struct ivee** out_ivee_ptr)
+{
+    return ivee_create_config(caps, NULL, out_ivee_ptr);
+}
+
 void ivee_destroy(struct ivee* ivee)
 {
     if (!ivee) {
         return;
     }
 
+    /* Worker threads might still be running a call */
+    ivee_service_destroy(ivee->service);
+    ivee_async_destroy(ivee->async);
     ivee_release_kvm_vm(ivee->vm);
+    ivee_free_memory_map(&ivee->memory_map);
+    ivee_free(ivee->dirty_bitmap);
+    ivee_stats_unregister(&ivee->stats);
+    pthread_mutex_destroy(&ivee->kick_lock);
     ivee_free(ivee);
 }
 
+int ivee_set_memory_backing(struct ivee* ivee, enum ivee_memory_backing backing)
+{
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    if (!is_valid_memory_backing(backing)) {
+        return -EINVAL;
+    }
+
+    ivee->memory_backing = backing;
+    return 0;
+}
+
+/*
+ * Guest GFN range to identity map
+ */
+struct gpt_range
+{
+    gpa_t first_gfn;
+    gpa_t last_gfn;
+    enum ivee_memory_prot prot;
+};
+
+static int compare_gpt_ranges(const void* a, const void* b)
+{
+    const struct gpt_range* ra = a;
+    const struct gpt_range* rb = b;
+    return (ra->first_gfn > rb->first_gfn) - (ra->first_gfn < rb->first_gfn);
+}
+
+/* Can entries at paging level be large page leaves? */
+static bool is_large_leaf_level(unsigned level, bool use_1g_pages)
+{
+    return level == 1 || (level == 2 && use_1g_pages);
+}
+
 /*
- * We need the following amount of 4KiB guest page table pages to map 1GiB of memory in 4KiB pages:
- * 1 for PML4 + 1 for PDPE + 1 for PDE + 512 for PTEs = 515 pages
+ * Count page table pages needed to identity map sorted non-overlapping GFN ranges.
  *
- * Statically compute guest GPA for PML4 base address if we map it at the end of 4GiB address space.
+ * A table at level L is needed for every unit of X86_LEVEL_PAGES(L + 1) pages touched by a range,
+ * unless that unit can be mapped with a single large page entry one level up,
+ * which is the case when one range covers all of it.
+ */
+static size_t count_page_table_pages(const struct gpt_range* ranges, size_t count, bool use_1g_pages)
+{
+    /* Always have the PML4 */
+    size_t total = 1;
+
+    for (unsigned level = 0; level < X86_PAGING_LEVELS - 1; ++level) {
+        uint64_t unit_pages = X86_LEVEL_PAGES(level + 1);
+        bool large_leaf = is_large_leaf_level(level + 1, use_1g_pages);
+        uint64_t last_counted = UINT64_MAX;
+
+        for (size_t i = 0; i < count; ++i) {
+            const struct gpt_range* r = &ranges[i];
+            uint64_t first_unit = r->first_gfn / unit_pages;
+            uint64_t last_unit = r->last_gfn / unit_pages;
+
+            for (uint64_t unit = first_unit; unit <= last_unit; ++unit) {
+                if (large_leaf) {
+                    /* Units strictly inside the range are fully covered */
+                    if (unit > first_unit && unit < last_unit) {
+                        unit = last_unit - 1;
+                        continue;
+                    }
+
+                    if (unit * unit_pages >= r->first_gfn && (unit + 1) * unit_pages - 1 <= r->last_gfn) {
+                        continue;
+                    }
+                }
+
+                /* Ranges are sorted, so units only repeat for adjacent ranges */
+                if (unit != last_counted) {
+                    last_counted = unit;
+                    ++total;
+                }
+            }
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Guest page table pages allocator
  */
-#define IVEE_GUEST_MEMORY_SIZE  (0x40000000ull)
-#define IVEE_GUEST_PAGES_COUNT  (IVEE_GUEST_MEMORY_SIZE >> X86_PAGE_SHIFT)
-#define IVEE_PAGE_TABLE_SIZE    (X86_PAGE_SIZE * 515)
-#define IVEE_PML4_BASE_GPA      (IVEE_GUEST_MEMORY_SIZE - IVEE_PAGE_TABLE_SIZE)
-#define IVEE_PDPE_BASE_GPA      (IVEE_PML4_BASE_GPA + X86_PAGE_SIZE)
-#define IVEE_PDE_BASE_GPA       (IVEE_PDPE_BASE_GPA + X86_PAGE_SIZE)
-#define IVEE_PTE_BASE_GPA       (IVEE_PDE_BASE_GPA + X86_PAGE_SIZE)
+struct gpt_builder
+{
+    /* Guest page table region */
+    struct ivee_guest_memory_region* mr;
+
+    /* Number of allocated pages */
+    size_t used;
+};
+
+static uint64_t* gpt_table_hva(struct gpt_builder* b, gpa_t gpa)
+{
+    return (uint64_t*)((uint8_t*)b->mr->hva + (gpa - (b->mr->first_gfn << X86_PAGE_SHIFT)));
+}
+
+/* Get next level table referenced by entry, allocating it if entry is not present */
+static uint64_t* gpt_next_table(struct gpt_builder* b, uint64_t* pentry)
+{
+    if (*pentry & X86_PTE_PRESENT) {
+        return gpt_table_hva(b, *pentry & X86_PTE_ADDR_MASK);
+    }
+
+    if (b->used == b->mr->last_gfn - b->mr->first_gfn + 1) {
+        return NULL;
+    }
+
+    gpa_t gpa = (b->mr->first_gfn + b->used++) << X86_PAGE_SHIFT;
+
+    /* Upper levels allow everything, we leave it to leaf entries to decide */
+    *pentry = gpa | X86_PTE_PRESENT | X86_PTE_RW;
+
+    uint64_t* table = gpt_table_hva(b, gpa);
+    memset(table, 0, X86_PAGE_SIZE);
+    return table;
+}
+
+/* Identity map GFN range using the largest pages possible */
+static int gpt_map_range(struct gpt_builder* b, uint64_t* pml4, const struct gpt_range* r, bool use_1g_pages)
+{
+    uint64_t flags = X86_PTE_PRESENT |
+                     (r->prot & IVEE_WRITE ? X86_PTE_RW : 0) |
+                     (r->prot & IVEE_EXEC ?  0 : X86_PTE_NX);
+
+    gpa_t gfn = r->first_gfn;
+    while (gfn <= r->last_gfn) {
+        uint64_t* table = pml4;
+        unsigned level = X86_PAGING_LEVELS - 1;
+
+        /* Walk down until we find the level where gfn can be mapped */
+        for (;;) {
+            uint64_t* pentry = &table[X86_LEVEL_INDEX(gfn, level)];
+            uint64_t level_pages = X86_LEVEL_PAGES(level);
+
+            if (level == 0) {
+                *pentry = (gfn << X86_PAGE_SHIFT) | flags;
+                gfn += 1;
+                break;
+            }
+
+            if (is_large_leaf_level(level, use_1g_pages) &&
+                (gfn & (level_pages - 1)) == 0 &&
+                r->last_gfn - gfn + 1 >= level_pages) {
+                *pentry = (gfn << X86_PAGE_SHIFT) | flags | X86_PTE_PS;
+                gfn += level_pages;
+                break;
+            }
+
+            table = gpt_next_table(b, pentry);
+            if (!table) {
+                return -ENOSPC;
+            }
+
+            --level;
+        }
+    }
+
+    return 0;
+}
 
 /*
- * Setup guest identity-mapped 4KB page tables based on current guest memory map.
+ * Setup guest identity-mapped page tables based on current guest memory map.
  * Memory map should be finalized at this point.
  *
- * We will allocate and map host memory enough to hold full 1GiB guest identity mapping,
- * however only currently mapped physical memory will be mapped in those page tables.
- * The rest is reserved for guest to make it's own mappings when needed.
+ * Regions are mapped with 2MiB pages (and 1GiB pages if allowed) wherever their GFN range permits,
+ * falling back to 4KiB pages at unaligned edges. Page table region is sized exactly
+ * for the tables we need and placed at the end of guest memory reserve, it maps itself as well.
  */
-static int init_guest_page_table(struct ivee* ivee)
+static int init_guest_page_table(struct ivee* ivee, bool use_1g_pages)
 {
-    /* Allocate and map entire page table space.
-     * This has an additional benefit of mapping page table pages region first,
-     * which we will reflect in page tables later. */
-    ivee->gpt_mr = ivee_map_host_memory(&ivee->memory_map,
-                                        IVEE_PML4_BASE_GPA,
-                                        IVEE_PAGE_TABLE_SIZE,
-                                        -1,
-                                        false,
-                                        IVEE_READ | IVEE_WRITE);
-    if (!ivee->gpt_mr) {
+    int res = 0;
+
+    /* Buffer window is mapped ahead of time, buffers come and go without touching page tables */
+    size_t nranges = ivee->memory_map.nregions + (ivee->layout.buffer_size ? 1 : 0);
+    struct ivee_guest_memory_region* mr;
+
+    /* Guest ranges and the same with page table region added */
+    struct gpt_range* ranges = ivee_zalloc((2 * nranges + 1) * sizeof(*ranges));
+    if (!ranges) {
         return -ENOMEM;
     }
 
-    uint64_t* pentry = (uint64_t*) ivee->gpt_mr->hva;
+    struct gpt_range* all_ranges = ranges + nranges;
+    uint64_t guest_pages = ivee->config.memory_size >> X86_PAGE_SHIFT;
+
+    size_t i = 0;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        ranges[i].first_gfn = mr->first_gfn;
+        ranges[i].last_gfn = mr->last_gfn;
+        ranges[i].prot = mr->prot;
+        ++i;
+    }
+
+    if (ivee->layout.buffer_size) {
+        ranges[i].first_gfn = ivee->layout.buffer_base >> X86_PAGE_SHIFT;
+        ranges[i].last_gfn = ((ivee->layout.buffer_base + ivee->layout.buffer_size) >> X86_PAGE_SHIFT) - 1;
+        ranges[i].prot = IVEE_READ | IVEE_WRITE;
+    }
 
-    /* 1 entry in PML4 always present */
-    *pentry = IVEE_PDPE_BASE_GPA | X86_PTE_PRESENT;
-    pentry += X86_PAGE_SIZE / sizeof(*pentry);
+    qsort(ranges, nranges, sizeof(*ranges), compare_gpt_ranges);
 
-    /* 1 entry in PDPE always present */
-    *pentry = IVEE_PDE_BASE_GPA | X86_PTE_PRESENT;
-    pentry += X86_PAGE_SIZE / sizeof(*pentry);
+    /*
+     * Page table region needs to map itself, which may need more tables.
+     * Grow it until it can hold everything, this converges in a couple of iterations.
+     */
+    size_t npages = count_page_table_pages(ranges, nranges, use_1g_pages);
+    for (;;) {
+        memcpy(all_ranges, ranges, nranges * sizeof(*ranges));
+        all_ranges[nranges].first_gfn = guest_pages - npages;
+        all_ranges[nranges].last_gfn = guest_pages - 1;
+        all_ranges[nranges].prot = IVEE_READ | IVEE_WRITE;
+        qsort(all_ranges, nranges + 1, sizeof(*all_ranges), compare_gpt_ranges);
+
+        size_t needed = count_page_table_pages(all_ranges, nranges + 1, use_1g_pages);
+        if (needed <= npages) {
+            break;
+        }
 
-    /* 4KiB worth of PDE mappings always present */
-    for (size_t i = 0; i < X86_PTES_PER_PAGE; ++i, ++pentry) {
-        *pentry = (IVEE_PTE_BASE_GPA + X86_PAGE_SIZE * i) | X86_PTE_PRESENT | X86_PTE_RW;
+        npages = needed;
     }
 
-    /* Mark all PTEs as non-present first */
-    uint64_t* pte_pages_base = pentry;
-    memset(pte_pages_base, 0, IVEE_GUEST_PAGES_COUNT * sizeof(*pentry));
+    if (npages > (IVEE_PAGE_TABLE_RESERVE >> X86_PAGE_SHIFT)) {
+        res = -ENOSPC;
+        goto out;
+    }
 
-    /* Go over guest regions and map present PTE entries */
-    struct ivee_guest_memory_region* mr;
-    LIST_FOREACH(mr, &ivee->memory_map.regions, link) {
-        for (uint64_t gfn = mr->first_gfn; gfn <= mr->last_gfn; ++gfn) {
-            uint64_t* ppte = &pte_pages_base[((gfn >> 9) & 0x1FF) * X86_PTES_PER_PAGE];
-            ppte[gfn & 0x1FF] = (gfn << X86_PAGE_SHIFT) |
-                (mr->prot & IVEE_WRITE ? X86_PTE_RW : 0) |
-                (mr->prot & IVEE_EXEC ?  0 : X86_PTE_NX) |
-                X86_PTE_PRESENT;
+    ivee->gpt_mr = ivee_map_host_memory(&ivee->memory_map,
+                                        (guest_pages - npages) << X86_PAGE_SHIFT,
+                                        npages << X86_PAGE_SHIFT,
+                                        -1,
+                                        0,
+                                        false,
+                                        IVEE_MEMORY_SHARED,
+                                        IVEE_READ | IVEE_WRITE);
+    if (!ivee->gpt_mr) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    /* PML4 is the first page */
+    struct gpt_builder builder = { .mr = ivee->gpt_mr, .used = 1 };
+    uint64_t* pml4 = (uint64_t*)ivee->gpt_mr->hva;
+    memset(pml4, 0, X86_PAGE_SIZE);
+
+    for (i = 0; i < nranges + 1; ++i) {
+        res = gpt_map_range(&builder, pml4, &all_ranges[i], use_1g_pages);
+        if (res != 0) {
+            goto out;
         }
     }
 
-    return 0;
+out:
+    ivee_free(ranges);
+    return res;
 }
 
 static void reset_x86_segment(struct x86_segment* seg,
@@ -179,7 +488,7 @@ static void reset_x86_segment(struct x86_segment* seg,
  * Set initial state for x86 boot processor.
  * We are putting the cpu directly in x86_64 long mode.
  */
-static void init_x86_cpu(struct x86_cpu_state* x86_cpu)
+static void init_x86_cpu(struct x86_cpu_state* x86_cpu, gpa_t pml4_gpa)
 {
     /*
      * IDT and GDT limits are also set to 0 here,
@@ -217,203 +526,225 @@ static void init_x86_cpu(struct x86_cpu_state* x86_cpu)
      * Setup the rest of 64-bit control register context
      */
     x86_cpu->cr0 = 0x80010001;  /* PG | PE | WP */
-    x86_cpu->cr4 = 0x20;        /* PAE */
-    x86_cpu->efer = 0x500;      /* LMA | LME */
-    x86_cpu->cr3 = IVEE_PML4_BASE_GPA;
+    x86_cpu->cr4 = X86_CR4_PAE | X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+    if (ivee_kvm_cpu_features() & IVEE_CPU_XSAVE) {
+        x86_cpu->cr4 |= X86_CR4_OSXSAVE;
+    }
+
+    x86_cpu->efer = 0xD00;      /* NXE | LMA | LME */
+    x86_cpu->cr3 = pml4_gpa;
+
+    /* Nothing of this was loaded into vcpu yet */
+    x86_cpu->dirty = X86_CPU_STATE_ALL;
 }
 
-/* Load flat binary into VM and create a page table for it */
-static int load_bin(struct ivee* ivee, const char* file)
+/* Does GPA range intersect any of image segments? */
+static bool overlaps_image(const struct ivee_image* img, gpa_t gpa, uint64_t size)
 {
-    int res = 0;
+    for (size_t i = 0; i < img->nsegments; ++i) {
+        const struct ivee_image_segment* seg = &img->segments[i];
+        if (gpa < seg->gpa + seg->length && seg->gpa < gpa + size) {
+            return true;
+        }
+    }
 
-    struct stat st;
-    res = stat(file, &st);
-    if (res != 0) {
-        return res;
+    return false;
+}
+
+/* Map stack and preallocated heap around loaded image segments according to configuration */
+static int map_stack_and_heap(struct ivee* ivee, const struct ivee_image* img)
+{
+    const struct ivee_config* config = &ivee->config;
+    uint64_t usable_size = config->memory_size - IVEE_PAGE_TABLE_RESERVE;
+
+    /* Image should fit below page tables */
+    gpa_t image_end = 0;
+    for (size_t i = 0; i < img->nsegments; ++i) {
+        const struct ivee_image_segment* seg = &img->segments[i];
+        if (seg->gpa + seg->length > image_end) {
+            image_end = seg->gpa + seg->length;
+        }
+    }
+
+    if (image_end > usable_size) {
+        return -ENOSPC;
     }
 
-    size_t size = st.st_size;
-    if (size == 0) {
+    struct ivee_memory_layout* layout = &ivee->layout;
+    memset(layout, 0, sizeof(*layout));
+    layout->memory_size = config->memory_size;
+    layout->stack_top = config->stack_top;
+    layout->stack_base = config->stack_top - config->stack_size;
+    layout->buffer_base = config->memory_size;
+    layout->buffer_size = config->buffer_window_size;
+
+    if (overlaps_image(img, layout->stack_base, config->stack_size)) {
         return -EINVAL;
     }
 
-    /*
-     * Memory map the binary and map that into guest directly for readonly.
-     * No other memory is mapped.
-     */
+    /* Guest should never execute its stack or heap */
+    if (!ivee_map_host_memory(&ivee->memory_map,
+                              layout->stack_base,
+                              config->stack_size,
+                              -1,
+                              0,
+                              false,
+                              ivee->memory_backing,
+                              IVEE_READ | IVEE_WRITE)) {
+        return -ENOMEM;
+    }
+
+    if (config->heap_size == 0) {
+        return 0;
+    }
+
+    layout->heap_size = config->heap_size;
+    layout->heap_base = (config->heap_base ? config->heap_base : ALIGN_UP(image_end, IVEE_LAYOUT_ALIGN));
 
-    int fd = open(file, O_RDONLY);
-    if (fd < 0) {
-        return fd;
+    if (layout->heap_base + layout->heap_size > usable_size ||
+        (layout->heap_base < layout->stack_top && layout->stack_base < layout->heap_base + layout->heap_size) ||
+        overlaps_image(img, layout->heap_base, layout->heap_size)) {
+        return -EINVAL;
     }
 
-    ivee->entry_addr = 0x400000;
-    struct ivee_guest_memory_region* image_mr = ivee_map_host_memory(&ivee->memory_map,
-                                                                     ivee->entry_addr,
-                                                                     size,
-                                                                     fd,
-                                                                     true,
-                                                                     IVEE_READ | IVEE_EXEC);
-    close(fd);
-    if (!image_mr) {
+    if (!ivee_map_host_memory(&ivee->memory_map,
+                              layout->heap_base,
+                              layout->heap_size,
+                              -1,
+                              0,
+                              false,
+                              ivee->memory_backing,
+                              IVEE_READ | IVEE_WRITE)) {
         return -ENOMEM;
     }
 
     return 0;
 }
 
-int load_elf64(struct ivee* ivee, const char* file)
+int ivee_load_image(struct ivee* ivee, const struct ivee_image* img)
 {
     int res = 0;
 
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        return -ENOTSUP;
-    }
-
-    int fd = open(file, O_RDONLY);
-    if (fd < 0) {
-        return fd;
-    }
-
-    Elf* elf = elf_begin(fd, ELF_C_READ, NULL);
-    if (!elf) {
-        res = -elf_errno();
-        goto error_out;
+    if (!ivee || !img) {
+        return -EINVAL;
     }
 
-    if (elf_kind(elf) != ELF_K_ELF) {
-        res = -elf_errno();
-        goto error_out;
+    /* Something is already loaded */
+    if (ivee->gpt_mr) {
+        return -EBUSY;
     }
 
-    /*
-     * Accepted ELF type: ELF64 executable or dso
-     */
+    for (size_t i = 0; i < img->nsegments; ++i) {
+        const struct ivee_image_segment* seg = &img->segments[i];
+        bool file_mapped = (seg->file_offset >= 0);
+
+        struct ivee_guest_memory_region* mr = ivee_map_host_memory(&ivee->memory_map,
+                                                                   seg->gpa,
+                                                                   seg->length,
+                                                                   (file_mapped ? img->fd : -1),
+                                                                   (file_mapped ? seg->file_offset : 0),
+                                                                   file_mapped,
+                                                                   (file_mapped ? IVEE_MEMORY_SHARED : ivee->memory_backing),
+                                                                   seg->prot);
+        if (!mr) {
+            res = -ENOMEM;
+            goto error_out;
+        }
 
-    GElf_Ehdr ehdr;
-    if (!gelf_getehdr(elf, &ehdr)) {
-        res = -elf_errno();
-        goto error_out;
+        /* Anonymous memory is already zeroed */
+        if (seg->data_size > 0) {
+            memcpy((uint8_t*)mr->hva + seg->data_offset, seg->data, seg->data_size);
+        }
     }
 
-    if (gelf_getclass(elf) != ELFCLASS64) {
-        res = -ENOTSUP;
+    res = map_stack_and_heap(ivee, img);
+    if (res != 0) {
         goto error_out;
     }
 
-    if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) {
-        res = -ENOTSUP;
+    res = init_guest_page_table(ivee, ivee_kvm_cpu_features() & IVEE_CPU_PDPE1GB);
+    if (res != 0) {
         goto error_out;
     }
 
-    if (ehdr.e_machine != EM_X86_64) {
-        res = -ENOTSUP;
+    res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    if (res != 0) {
         goto error_out;
     }
 
-    /*
-     * For each segment in program header table:
-     * - Create a memory region to be mapped into guest with proper permissions
-     * - Load segment into memory region
-     * - Map region into guest address space at the base address specified in segment entry
-     */
-
-    for (size_t i = 0; i < ehdr.e_phnum; ++i ) {
-        GElf_Phdr phdr;
-
-        if (gelf_getphdr(elf, i, &phdr) != &phdr) {
-            res = -elf_errno();
-            goto error_out;
-        }
-
-        if (phdr.p_type != PT_LOAD) {
-            continue;
-        }
-
-        struct ivee_guest_memory_region* segment_mr = ivee_map_host_memory(&ivee->memory_map,
-                                                                           phdr.p_vaddr,
-                                                                           phdr.p_memsz,
-                                                                           -1,
-                                                                           false,
-                                                                           (phdr.p_flags & PF_X ? IVEE_EXEC : 0) |
-                                                                           (phdr.p_flags & PF_R ? IVEE_READ : 0) |
-                                                                           (phdr.p_flags & PF_W ? IVEE_WRITE : 0));
-        if (!segment_mr) {
-            goto error_out;
-        }
-
-        ssize_t nbytes = pread(fd, segment_mr->hva, phdr.p_filesz, phdr.p_offset);
-        if (nbytes != phdr.p_filesz) {
-            res = -errno;
-            goto error_out;
-        }
-    }
-
-    ivee->entry_addr = ehdr.e_entry;
-
-    elf_end(elf);
-    close(fd);
-
+    ivee->layout.page_table_base = ivee->gpt_mr->first_gfn << X86_PAGE_SHIFT;
+    ivee->layout.page_table_size = ivee->gpt_mr->length;
+    ivee->entry_addr = img->entry_addr;
+    init_x86_cpu(&ivee->x86_cpu, ivee->gpt_mr->first_gfn << X86_PAGE_SHIFT);
     return 0;
 
 error_out:
-    elf_end(elf);
-    close(fd);
-
+    /* On failure drop memory map we've accumulated */
+    ivee_clear_memory_map(&ivee->memory_map);
+    ivee->gpt_mr = NULL;
     return res;
 }
 
-int load_any(struct ivee* ivee, const char* file)
+int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_format_t format)
 {
     int res = 0;
 
-    res = load_elf64(ivee, file);
-    if (res == 0) {
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    struct ivee_image* img = NULL;
+    res = ivee_image_open(file, format, &img);
+    if (res != 0) {
         return res;
     }
 
-    return load_bin(ivee, file);
+    res = ivee_load_image(ivee, img);
+    ivee_image_close(img);
+    return res;
 }
 
-int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_format_t format)
+int ivee_clone(const struct ivee* template, struct ivee** out_ivee_ptr)
 {
     int res = 0;
 
-    if (!ivee) {
+    if (!template || !out_ivee_ptr) {
         return -EINVAL;
     }
 
-    if (!file) {
+    /* Nothing is loaded in template */
+    if (!template->gpt_mr) {
         return -EINVAL;
     }
 
-    /* We must have read and execute access for the file */
-    if (0 != access(file, R_OK | X_OK)) {
-        return -EINVAL;
+    struct ivee* ivee = NULL;
+    res = ivee_create_config(template->caps, &template->config, &ivee);
+    if (res != 0) {
+        return res;
     }
 
-    switch (format) {
-    case IVEE_EXEC_BIN:
-        res = load_bin(ivee, file);
-        break;
-    case IVEE_EXEC_ELF64:
-        res = load_elf64(ivee, file);
-        break;
-    case IVEE_EXEC_ANY:
-        res = load_any(ivee, file);
-        break;
-    default:
-        res = -ENOTSUP;
-    };
+    /* Map private views of all template regions, this also takes care of page tables */
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &template->memory_map) {
+        /* Template buffers belong to the template */
+        if (mr->user_owned) {
+            continue;
+        }
 
-    if (res != 0) {
-        goto error_out;
-    }
+        struct ivee_guest_memory_region* clone_mr = ivee_clone_host_memory(&ivee->memory_map, mr);
+        if (!clone_mr) {
+            /* Template is a clone itself, its memory was made private by reset snapshot or we're out of resources */
+            if (mr->is_private) {
+                res = (template->is_clone ? -EINVAL : -EBUSY);
+            } else {
+                res = -ENOMEM;
+            }
+            goto error_out;
+        }
 
-    res = init_guest_page_table(ivee);
-    if (res != 0) {
-        goto error_out;
+        if (mr == template->gpt_mr) {
+            ivee->gpt_mr = clone_mr;
+        }
     }
 
     res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
@@ -421,25 +752,73 @@ int ivee_load_executable(struct ivee* ivee, const char* file, ivee_executable_fo
         goto error_out;
     }
 
-    init_x86_cpu(&ivee->x86_cpu);
+    /* Fresh vcpu needs the entire state */
+    ivee->x86_cpu = template->x86_cpu;
+    ivee->x86_cpu.dirty = X86_CPU_STATE_ALL;
+    ivee->entry_addr = template->entry_addr;
+    ivee->layout = template->layout;
+    ivee->memory_backing = template->memory_backing;
+    ivee->is_clone = true;
+    memcpy(ivee->hypercalls, template->hypercalls, sizeof(ivee->hypercalls));
+
+    *out_ivee_ptr = ivee;
     return 0;
 
 error_out:
-    /* On failure drop memory map we've accumulated */
-    ivee_free_memory_map(&ivee->memory_map);
+    ivee_destroy(ivee);
     return res;
 }
 
-static int load_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
+/* Put vector registers selected by ext mask into vcpu */
+static int load_vector_state(struct ivee* ivee, const struct ivee_arch_state_ext* ext)
 {
-    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
-    x86_cpu->rax = state->rax;
-    x86_cpu->rbx = state->rbx;
-    x86_cpu->rcx = state->rcx;
-    x86_cpu->rdx = state->rdx;
-    x86_cpu->rsi = state->rsi;
-    x86_cpu->rdi = state->rdi;
-    x86_cpu->rbp = state->rbp;
+    void* xsave = ivee_kvm_xsave_area(ivee->vm);
+    if (!xsave) {
+        return -ENOMEM;
+    }
+
+    /* We only change some registers, the rest of the area should reflect the vcpu */
+    if (!ivee->xsave_valid) {
+        int res = ivee_kvm_store_xsave(ivee->vm);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    ivee_xsave_put(xsave, ext);
+    ivee->xsave_valid = true;
+    return ivee_kvm_load_xsave(ivee->vm);
+}
+
+static int store_vector_state(struct ivee* ivee, struct ivee_arch_state_ext* ext)
+{
+    int res = ivee_kvm_store_xsave(ivee->vm);
+    if (res != 0) {
+        return res;
+    }
+
+    ivee->xsave_valid = true;
+    ivee_xsave_get(ivee_kvm_xsave_area(ivee->vm), ext);
+    return 0;
+}
+
+/*
+ * Put caller state into vcpu registers.
+ * Resumed guest continues at its yield point with its own RSP and RFLAGS.
+ */
+static int load_vcpu_state(struct ivee* ivee,
+                           struct ivee_arch_state* state,
+                           const struct ivee_arch_state_ext* ext,
+                           bool resume)
+{
+    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
+    x86_cpu->rax = state->rax;
+    x86_cpu->rbx = state->rbx;
+    x86_cpu->rcx = state->rcx;
+    x86_cpu->rdx = state->rdx;
+    x86_cpu->rsi = state->rsi;
+    x86_cpu->rdi = state->rdi;
+    x86_cpu->rbp = state->rbp;
     x86_cpu->r8 = state->r8;
     x86_cpu->r9 = state->r9;
     x86_cpu->r10 = state->r10;
@@ -448,15 +827,36 @@ static int load_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
     x86_cpu->r13 = state->r13;
     x86_cpu->r14 = state->r14;
     x86_cpu->r15 = state->r15;
-    x86_cpu->rip = ivee->entry_addr;
+
+    if (resume) {
+        /* RIP still points to the yield port write, KVM skips it when completing the exit */
+    } else if (ext && (ext->mask & IVEE_ARCH_STATE_RSP_RFLAGS)) {
+        x86_cpu->rip = ivee->entry_addr;
+        x86_cpu->rsp = ext->rsp;
+        x86_cpu->rflags = ext->rflags | 0x2; /* Bit 1 is always set */
+    } else {
+        x86_cpu->rip = ivee->entry_addr;
+        x86_cpu->rsp = ivee->layout.stack_top;
+        x86_cpu->rflags = 0x2;
+    }
+
+    x86_cpu->dirty |= X86_CPU_STATE_REGS;
+
+    if (ext && (ext->mask & ~IVEE_ARCH_STATE_RSP_RFLAGS)) {
+        int res = load_vector_state(ivee, ext);
+        if (res != 0) {
+            return res;
+        }
+    }
 
     return ivee_kvm_load_vcpu_state(ivee->vm, x86_cpu);
 }
 
-static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
+static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state, struct ivee_arch_state_ext* ext)
 {
     struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
-    int res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu);
+    /* Guest has no business changing segments or control registers, we only care about GPRs */
+    int res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu, X86_CPU_STATE_REGS);
     if (res != 0) {
         return res;
     }
@@ -467,6 +867,7 @@ static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
     state->rdx = x86_cpu->rdx;
     state->rsi = x86_cpu->rsi;
     state->rdi = x86_cpu->rdi;
+    state->rbp = x86_cpu->rbp;
     state->r8 = x86_cpu->r8;
     state->r9 = x86_cpu->r9;
     state->r10 = x86_cpu->r10;
@@ -476,9 +877,84 @@ static int store_vcpu_state(struct ivee* ivee, struct ivee_arch_state* state)
     state->r14 = x86_cpu->r14;
     state->r15 = x86_cpu->r15;
 
+    if (!ext) {
+        return 0;
+    }
+
+    if (ext->mask & IVEE_ARCH_STATE_RSP_RFLAGS) {
+        ext->rsp = x86_cpu->rsp;
+        ext->rflags = x86_cpu->rflags;
+    }
+
+    if (ext->mask & ~IVEE_ARCH_STATE_RSP_RFLAGS) {
+        return store_vector_state(ivee, ext);
+    }
+
     return 0;
 }
 
+static uint64_t dispatch_hypercall(struct ivee* ivee, uint64_t nr, const uint64_t args[IVEE_HYPERCALL_ARGS])
+{
+    const struct ivee_hypercall* hc = (nr < IVEE_HYPERCALL_MAX ? &ivee->hypercalls[nr] : NULL);
+    if (!hc || !hc->fn) {
+        return (uint64_t)-ENOSYS;
+    }
+
+    return hc->fn(ivee, hc->ctx, args);
+}
+
+/* Run hypercalls guest has queued in batch page at gpa, returns number of entries run */
+static int64_t run_batch(struct ivee* ivee, gpa_t gpa)
+{
+    if (gpa & (X86_PAGE_SIZE - 1)) {
+        return -EINVAL;
+    }
+
+    struct ivee_batch_page* page = ivee_memory_map_hva(&ivee->memory_map, gpa, sizeof(*page),
+                                                       IVEE_READ | IVEE_WRITE);
+    if (!page) {
+        return -EFAULT;
+    }
+
+    uint32_t count = page->header.count;
+    if (count > IVEE_BATCH_ENTRIES) {
+        return -EINVAL;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        struct ivee_batch_entry* entry = &page->entries[i];
+        entry->result = dispatch_hypercall(ivee, entry->nr, entry->args);
+    }
+
+    return count;
+}
+
+/*
+ * Call host function for guest, or a batch of them if batch is set, and put the result in RAX.
+ * Vcpu is still at the OUT instruction, KVM skips it when we resume with the same RIP.
+ */
+static int handle_hypercall(struct ivee* ivee, bool batch)
+{
+    struct x86_cpu_state* x86_cpu = &ivee->x86_cpu;
+    int res = ivee_kvm_store_vcpu_state(ivee->vm, x86_cpu, X86_CPU_STATE_REGS);
+    if (res != 0) {
+        return res;
+    }
+
+    if (batch) {
+        x86_cpu->rax = (uint64_t)run_batch(ivee, x86_cpu->rdi);
+    } else {
+        const uint64_t args[IVEE_HYPERCALL_ARGS] = {
+            x86_cpu->rdi, x86_cpu->rsi, x86_cpu->rdx, x86_cpu->r10, x86_cpu->r8, x86_cpu->r9,
+        };
+
+        x86_cpu->rax = dispatch_hypercall(ivee, x86_cpu->rax, args);
+    }
+
+    x86_cpu->dirty |= X86_CPU_STATE_REGS;
+    return ivee_kvm_load_vcpu_state(ivee->vm, x86_cpu);
+}
+
 static int handle_pio(struct ivee* ivee, struct ivee_pio_exit* pio)
 {
     switch (pio->port) {
@@ -486,46 +962,522 @@ static int handle_pio(struct ivee* ivee, struct ivee_pio_exit* pio)
         /* Don't care about value */
         ivee->should_terminate = true;
         return 0;
+    case IVEE_PIO_NOP_PORT:
+        /* Guest just wanted an exit */
+        return 0;
+    case IVEE_PIO_YIELD_PORT:
+        ivee->should_terminate = true;
+        ivee->yielded = true;
+        return 0;
+    case IVEE_PIO_HYPERCALL_PORT:
+        return handle_hypercall(ivee, false);
+    case IVEE_PIO_BATCH_PORT:
+        return handle_hypercall(ivee, true);
+    case IVEE_PIO_SERVICE_NOTIFY_PORT:
+        /* Service pointer stays the same while its loop is running */
+        if (ivee->service) {
+            ivee_service_notify(ivee->service);
+        }
+        return 0;
     default:
         return -ENOTSUP;
     }
 }
 
-int ivee_call(struct ivee* ivee, struct ivee_arch_state* state)
+/* Kick vcpu thread out of the current call, if there is one */
+static void kick_call(struct ivee* ivee, int reason)
 {
-    int res = 0;
+    pthread_mutex_lock(&ivee->kick_lock);
 
-    if (!ivee || !state) {
-        return -EINVAL;
+    /* Exit request covers the window before vcpu thread enters KVM_RUN, signal covers the guest */
+    if (ivee->in_call && ivee->kick_reason == 0) {
+        ivee->kick_reason = reason;
+        ivee_kvm_request_exit(ivee->vm);
+        pthread_kill(ivee->vcpu_thread, IVEE_KICK_SIGNAL);
+
+        /* Signals don't get vcpu thread out of a guest halt */
+        if (ivee->service) {
+            ivee_service_kick(ivee->service);
+        }
+    }
+
+    pthread_mutex_unlock(&ivee->kick_lock);
+}
+
+static void call_timer_expired(struct ivee_timer* timer)
+{
+    kick_call((struct ivee*)((uint8_t*)timer - offsetof(struct ivee, call_timer)), ETIMEDOUT);
+}
+
+static int begin_call(struct ivee* ivee)
+{
+    pthread_mutex_lock(&ivee->kick_lock);
+    ivee->vcpu_thread = pthread_self();
+    ivee->in_call = true;
+    ivee->kick_reason = 0;
+
+    /* Only call allowed while service loop runs is the loop itself, which lives as long as the service does */
+    bool timed = (ivee->call_timeout_ns != 0 && !ivee->service);
+    pthread_mutex_unlock(&ivee->kick_lock);
+
+    ivee->call_timer_armed = false;
+    if (!timed) {
+        return 0;
+    }
+
+    ivee->call_timer.expire = call_timer_expired;
+    int res = ivee_timer_start(&ivee->call_timer, ivee_monotonic_ns() + ivee->call_timeout_ns);
+    if (res != 0) {
+        return res;
+    }
+
+    ivee->call_timer_armed = true;
+    return 0;
+}
+
+static void end_call(struct ivee* ivee)
+{
+    if (ivee->call_timer_armed) {
+        ivee_timer_stop(&ivee->call_timer);
+    }
+
+    pthread_mutex_lock(&ivee->kick_lock);
+    ivee->in_call = false;
+    pthread_mutex_unlock(&ivee->kick_lock);
+
+    /* Nobody can request exits now */
+    ivee_kvm_clear_exit_request(ivee->vm);
+}
+
+/* Figure out why vcpu was interrupted, returns 0 if we should go on */
+static int handle_interrupt(struct ivee* ivee)
+{
+    pthread_mutex_lock(&ivee->kick_lock);
+    int reason = ivee->kick_reason;
+    pthread_mutex_unlock(&ivee->kick_lock);
+
+    /* Otherwise someone else has sent us the kick signal */
+    return -reason;
+}
+
+/* Halted guest is only expected to be a service loop with nothing to do */
+static int handle_hlt(struct ivee* ivee)
+{
+    if (!ivee->service) {
+        return -ENOTSUP;
     }
 
-    res = load_vcpu_state(ivee, state);
+    ivee_service_idle(ivee->service);
+    return 0;
+}
+
+static int run_call(struct ivee* ivee, struct ivee_arch_state* state, struct ivee_arch_state_ext* ext, bool resume)
+{
+    int res = 0;
+
+    res = load_vcpu_state(ivee, state, ext, resume);
     if (res != 0) {
         return res;
     }
 
     ivee->should_terminate = false;
+    ivee->yielded = false;
 
     do {
         struct ivee_exit exit;
         res = ivee_kvm_run(ivee->vm, &exit);
+        ivee->xsave_valid = false;
         if (res != 0) {
             return res;
         }
 
+        ivee_stats_record_exit(&ivee->stats.counters, &exit);
+
         switch (exit.exit_reason) {
         case IVEE_EXIT_IO:
             res = handle_pio(ivee, &exit.io);
             break;
+        case IVEE_EXIT_INTERRUPTED:
+            res = handle_interrupt(ivee);
+            break;
+        case IVEE_EXIT_HLT:
+            res = handle_hlt(ivee);
+            break;
         default:
             res = -ENOTSUP;
             break;
         }
 
         if (res != 0) {
+            /* Otherwise next call would start by finishing whatever guest instruction exited */
+            ivee_kvm_complete_exit(ivee->vm);
             return res;
         }
     } while (!ivee->should_terminate);
 
-    return store_vcpu_state(ivee, state);
+    res = store_vcpu_state(ivee, state, ext);
+    if (res != 0) {
+        return res;
+    }
+
+    return (ivee->yielded ? IVEE_CALL_YIELDED : 0);
+}
+
+/* Run a call or resume a yielded one, keeping track of everything around running the guest */
+static int do_call(struct ivee* ivee, struct ivee_arch_state* state, struct ivee_arch_state_ext* ext, bool resume)
+{
+    int res = 0;
+
+    uint64_t start = ivee_rdtsc();
+    uint64_t run_cycles = ivee->stats.counters.run_cycles;
+
+    /* New call abandons a yielded one, which skipped its reset */
+    if (!resume && ivee->yielded && ivee->reset_policy == IVEE_RESET_ON_CALL) {
+        res = ivee_reset(ivee);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    ivee->has_run = true;
+    res = begin_call(ivee);
+    if (res == 0) {
+        res = run_call(ivee, state, ext, resume);
+    }
+
+    end_call(ivee);
+
+    /* Call was cut short, guest could have left vcpu in any state */
+    if (res < 0) {
+        ivee->x86_cpu.dirty = X86_CPU_STATE_ALL;
+        ivee->yielded = false;
+    }
+
+    /* Yielded call is not over yet */
+    if (ivee->reset_policy == IVEE_RESET_ON_CALL && res != IVEE_CALL_YIELDED) {
+        int reset_res = ivee_reset(ivee);
+        if (res == 0) {
+            res = reset_res;
+        }
+    }
+
+    ivee_stats_record_call(&ivee->stats.counters,
+                           ivee_rdtsc() - start,
+                           ivee->stats.counters.run_cycles - run_cycles,
+                           res);
+    return res;
+}
+
+int ivee_call(struct ivee* ivee, struct ivee_arch_state* state)
+{
+    return ivee_call_ext(ivee, state, NULL);
+}
+
+int ivee_resume(struct ivee* ivee, struct ivee_arch_state* state)
+{
+    if (!ivee || !state || !ivee->yielded) {
+        return -EINVAL;
+    }
+
+    return do_call(ivee, state, NULL, true);
+}
+
+int ivee_call_ext(struct ivee* ivee, struct ivee_arch_state* state, struct ivee_arch_state_ext* ext)
+{
+    if (!ivee || !state) {
+        return -EINVAL;
+    }
+
+    if (ext) {
+        uint32_t vector_mask = ext->mask & ~IVEE_ARCH_STATE_RSP_RFLAGS;
+        if (ext->mask & ~(IVEE_ARCH_STATE_RSP_RFLAGS | IVEE_ARCH_STATE_XMM | IVEE_ARCH_STATE_YMM | IVEE_ARCH_STATE_ZMM)) {
+            return -EINVAL;
+        }
+
+        if (vector_mask) {
+            /* Both host and guest have to support all state components, legacy ones are always there */
+            uint64_t features = ivee_xsave_features(vector_mask);
+            if (!features || (features & ~(ivee_kvm_guest_xcr0() | X86_XSAVE_LEGACY_FEATURES))) {
+                return -ENOTSUP;
+            }
+        }
+    }
+
+    return do_call(ivee, state, ext, false);
+}
+
+int ivee_set_call_timeout(struct ivee* ivee, uint64_t timeout_ns)
+{
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    ivee->call_timeout_ns = timeout_ns;
+    return 0;
+}
+
+int ivee_cancel(struct ivee* ivee)
+{
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    kick_call(ivee, ECANCELED);
+    return 0;
+}
+
+int ivee_register_hypercall(struct ivee* ivee, uint32_t nr, ivee_hypercall_fn_t fn, void* ctx)
+{
+    if (!ivee || nr >= IVEE_HYPERCALL_MAX) {
+        return -EINVAL;
+    }
+
+    ivee->hypercalls[nr].fn = fn;
+    ivee->hypercalls[nr].ctx = (fn ? ctx : NULL);
+    return 0;
+}
+
+/* Find lowest free GPA range in the buffer window, keeping huge page offset of host memory */
+static int find_buffer_gpa(const struct ivee* ivee, uintptr_t hva, size_t length, gpa_t* out_gpa)
+{
+    const struct ivee_memory_layout* layout = &ivee->layout;
+    gpa_t window_end = layout->buffer_base + layout->buffer_size;
+
+    /* EPT can only use huge pages for a buffer if GPA and HVA are congruent modulo huge page size */
+    uint64_t align = (length >= IVEE_LAYOUT_ALIGN ? IVEE_LAYOUT_ALIGN : X86_PAGE_SIZE);
+    uint64_t offset = hva & (align - 1);
+
+    /* Regions are sorted, so a single pass skips past every buffer in the way */
+    gpa_t gpa = ALIGN_UP(layout->buffer_base - offset, align) + offset;
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        if (gpa > window_end || window_end - gpa < length) {
+            return -ENOSPC;
+        }
+
+        if ((mr->last_gfn << X86_PAGE_SHIFT) < gpa) {
+            continue;
+        }
+
+        if ((mr->first_gfn << X86_PAGE_SHIFT) >= gpa + length) {
+            break;
+        }
+
+        gpa = ALIGN_UP(((mr->last_gfn + 1) << X86_PAGE_SHIFT) - offset, align) + offset;
+    }
+
+    if (gpa > window_end || window_end - gpa < length) {
+        return -ENOSPC;
+    }
+
+    *out_gpa = gpa;
+    return 0;
+}
+
+int ivee_register_buffer(struct ivee* ivee, void* hva, size_t length, unsigned prot, uint64_t* out_gpa)
+{
+    int res = 0;
+
+    if (!ivee || !hva || !length || !out_gpa) {
+        return -EINVAL;
+    }
+
+    if ((prot & ~(IVEE_BUFFER_READ | IVEE_BUFFER_WRITE)) || !(prot & IVEE_BUFFER_READ)) {
+        return -EINVAL;
+    }
+
+    if (((uintptr_t)hva | length) & (X86_PAGE_SIZE - 1)) {
+        return -EINVAL;
+    }
+
+    /* Nothing is loaded yet, so there are no page tables to map the window */
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    gpa_t gpa;
+    res = find_buffer_gpa(ivee, (uintptr_t)hva, length, &gpa);
+    if (res != 0) {
+        return res;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_map_user_memory(&ivee->memory_map,
+                                                               gpa,
+                                                               hva,
+                                                               length,
+                                                               IVEE_READ | (prot & IVEE_BUFFER_WRITE ? IVEE_WRITE : 0));
+    if (!mr) {
+        return -ENOMEM;
+    }
+
+    res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    if (res != 0) {
+        ivee_unmap_host_memory(mr);
+        ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+        return res;
+    }
+
+    *out_gpa = gpa;
+    return 0;
+}
+
+int ivee_unregister_buffer(struct ivee* ivee, uint64_t gpa)
+{
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_memory_map_lookup(&ivee->memory_map, gpa);
+    if (!mr || !mr->user_owned || (mr->first_gfn << X86_PAGE_SHIFT) != gpa) {
+        return -ENOENT;
+    }
+
+    ivee_unmap_host_memory(mr);
+    return ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+}
+
+int ivee_get_memory_layout(const struct ivee* ivee, struct ivee_memory_layout* layout)
+{
+    if (!ivee || !layout) {
+        return -EINVAL;
+    }
+
+    /* Nothing is loaded yet */
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    *layout = ivee->layout;
+    return 0;
+}
+
+int ivee_get_stats(const struct ivee* ivee, struct ivee_stats* stats)
+{
+    if (!ivee || !stats) {
+        return -EINVAL;
+    }
+
+    *stats = ivee->stats.counters;
+    return 0;
+}
+
+int ivee_set_reset_policy(struct ivee* ivee, enum ivee_reset_policy policy)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    /* Nothing is loaded yet */
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    if (policy == ivee->reset_policy) {
+        return 0;
+    }
+
+    struct ivee_guest_memory_region* mr;
+
+    if (policy == IVEE_RESET_NONE) {
+        IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+            ivee_drop_host_memory_snapshot(mr);
+            mr->log_dirty = false;
+        }
+
+        ivee->reset_policy = policy;
+        return ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    }
+
+    if (policy != IVEE_RESET_MANUAL && policy != IVEE_RESET_ON_CALL) {
+        return -EINVAL;
+    }
+
+    /* Switching between manual and on-call resets keeps the snapshot we already have */
+    if (ivee->reset_policy != IVEE_RESET_NONE) {
+        ivee->reset_policy = policy;
+        return 0;
+    }
+
+    /* Snapshot guest writable memory as it is now and start logging guest writes to it */
+    size_t max_pages = 0;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        /* Buffer contents are up to the user */
+        if (!(mr->prot & IVEE_WRITE) || mr->user_owned) {
+            continue;
+        }
+
+        res = ivee_snapshot_host_memory(mr, ivee->has_run);
+        if (res != 0) {
+            goto error_out;
+        }
+
+        mr->log_dirty = true;
+
+        size_t npages = mr->last_gfn - mr->first_gfn + 1;
+        if (npages > max_pages) {
+            max_pages = npages;
+        }
+    }
+
+    ivee_free(ivee->dirty_bitmap);
+    ivee->dirty_bitmap = ivee_zalloc(((max_pages + 63) / 64) * sizeof(uint64_t));
+    if (!ivee->dirty_bitmap) {
+        res = -ENOMEM;
+        goto error_out;
+    }
+
+    res = ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    ivee->reset_x86_cpu = ivee->x86_cpu;
+    ivee->reset_policy = policy;
+    return 0;
+
+error_out:
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        ivee_drop_host_memory_snapshot(mr);
+        mr->log_dirty = false;
+    }
+
+    ivee_set_kvm_memory_map(ivee->vm, &ivee->memory_map);
+    return res;
+}
+
+int ivee_reset(struct ivee* ivee)
+{
+    int res = 0;
+
+    if (!ivee) {
+        return -EINVAL;
+    }
+
+    if (ivee->reset_policy == IVEE_RESET_NONE) {
+        return -EINVAL;
+    }
+
+    /* Only pages guest wrote to since last reset are copied back */
+    struct ivee_guest_memory_region* mr;
+    IVEE_MEMORY_MAP_FOREACH(mr, &ivee->memory_map) {
+        if (!mr->log_dirty) {
+            continue;
+        }
+
+        res = ivee_kvm_get_dirty_log(ivee->vm, mr, ivee->dirty_bitmap);
+        if (res != 0) {
+            return res;
+        }
+
+        ivee_restore_host_memory(mr, ivee->dirty_bitmap);
+    }
+
+    /* Guest might have changed anything in the vcpu */
+    ivee->x86_cpu = ivee->reset_x86_cpu;
+    ivee->x86_cpu.dirty = X86_CPU_STATE_ALL;
+    ivee->yielded = false;
+
+    return 0;
 }
@@ -1,24 +1,155 @@
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <linux/memfd.h>
 
 #include "platform.h"
 #include "memory.h"
 #include "kvm.h"
 #include "x86.h"
 
-struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* map,
-                                                      gpa_t gpa,
-                                                      size_t length,
-                                                      int mmap_fd,
-                                                      bool host_ro,
-                                                      enum ivee_memory_prot prot)
+#define HUGE_PAGE_SIZE_2M (1ul << 21)
+#define HUGE_PAGE_SIZE_1G (1ul << 30)
+
+/* Host page size we want to back guest memory with */
+static size_t backing_page_size(enum ivee_memory_backing backing)
 {
-    if (!map) {
+    switch (backing) {
+    case IVEE_MEMORY_SHARED_THP:
+    case IVEE_MEMORY_PRIVATE_THP:
+    case IVEE_MEMORY_HUGETLB_2M:
+        return HUGE_PAGE_SIZE_2M;
+    case IVEE_MEMORY_HUGETLB_1G:
+        return HUGE_PAGE_SIZE_1G;
+    default:
+        return X86_PAGE_SIZE;
+    }
+}
+
+/*
+ * Reserve host address range for length bytes such that it is congruent to gpa modulo align.
+ * KVM can only use huge EPT mappings when both guest and host addresses are aligned the same way.
+ */
+static void* reserve_aligned(size_t length, size_t align, gpa_t gpa)
+{
+    if (align <= X86_PAGE_SIZE) {
         return NULL;
     }
 
+    uint8_t* ptr = mmap(NULL, length + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    uintptr_t start = ((uintptr_t)ptr & ~(align - 1)) + (gpa & (align - 1));
+    if (start < (uintptr_t)ptr) {
+        start += align;
+    }
+
+    /* Trim the excess on both sides */
+    if (start > (uintptr_t)ptr) {
+        munmap(ptr, start - (uintptr_t)ptr);
+    }
+
+    if ((uintptr_t)ptr + length + align > start + length) {
+        munmap((void*)(start + length), (uintptr_t)ptr + length + align - (start + length));
+    }
+
+    return (void*)start;
+}
+
+/* Unmap region host memory, leaving a hole in reservation if it was there */
+static void release_host_memory(void* hva, size_t length, bool reserved)
+{
+    if (reserved) {
+        mmap(hva, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    } else {
+        munmap(hva, length);
+    }
+}
+
+/* Index of the first region that starts after gfn, or nregions if there is none */
+static size_t upper_bound(const struct ivee_memory_map* map, gpa_t gfn)
+{
+    size_t lo = 0;
+    size_t hi = map->nregions;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->regions[mid]->first_gfn <= gfn) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Check if GFN range overlaps any of the regions, only its neighbours in sorted order can */
+static bool overlaps_region(const struct ivee_memory_map* map, gpa_t first_gfn, gpa_t last_gfn)
+{
+    size_t index = upper_bound(map, first_gfn);
+    if (index > 0 && map->regions[index - 1]->last_gfn >= first_gfn) {
+        return true;
+    }
+
+    return index < map->nregions && map->regions[index]->first_gfn <= last_gfn;
+}
+
+/* Make sure there is room for one more region, so that inserting it can't fail */
+static int grow_regions(struct ivee_memory_map* map)
+{
+    if (map->nregions < map->capacity) {
+        return 0;
+    }
+
+    size_t capacity = (map->capacity ? map->capacity * 2 : 16);
+    struct ivee_guest_memory_region** regions = ivee_realloc(map->regions, capacity * sizeof(*regions));
+    if (!regions) {
+        return -ENOMEM;
+    }
+
+    map->regions = regions;
+    map->capacity = capacity;
+    return 0;
+}
+
+/* Put region in its sorted place, caller has checked for overlaps and room */
+static void insert_region(struct ivee_memory_map* map, struct ivee_guest_memory_region* mr)
+{
+    size_t index = upper_bound(map, mr->first_gfn);
+    memmove(&map->regions[index + 1], &map->regions[index], (map->nregions - index) * sizeof(*map->regions));
+    map->regions[index] = mr;
+    map->nregions++;
+    mr->map = map;
+}
+
+static void remove_region(struct ivee_memory_map* map, struct ivee_guest_memory_region* mr)
+{
+    size_t index = upper_bound(map, mr->first_gfn) - 1;
+    memmove(&map->regions[index], &map->regions[index + 1], (map->nregions - index - 1) * sizeof(*map->regions));
+    map->nregions--;
+}
+
+/*
+ * Map length bytes of fd at offset into the guest memory map at specified GPA.
+ * If fd is -1 anonymous memory is mapped.
+ * Region takes ownership of fd on success.
+ */
+static struct ivee_guest_memory_region* map_region(struct ivee_memory_map* map,
+                                                   gpa_t gpa,
+                                                   size_t length,
+                                                   int fd,
+                                                   off_t fd_offset,
+                                                   bool host_ro,
+                                                   bool map_private,
+                                                   enum ivee_memory_backing backing,
+                                                   enum ivee_memory_prot prot)
+{
     if (!length) {
         return NULL;
     }
@@ -34,27 +165,40 @@ struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* ma
     gpa_t first_gfn = gpa >> X86_PAGE_SHIFT;
     gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
 
-    /* Walk current regions and check for overlaps */
-    struct ivee_guest_memory_region* mr;
-    LIST_FOREACH(mr, &map->regions, link) {
-        if (first_gfn <= mr->last_gfn && last_gfn >= mr->first_gfn) {
-            return NULL;
-        }
+    if (overlaps_region(map, first_gfn, last_gfn) || grow_regions(map) != 0) {
+        return NULL;
     }
 
-    void* ptr = mmap(NULL,
+    /* Guest RAM goes to its place in the reservation, anything else is aligned on its own */
+    bool reserved = (gpa < map->reserved_size && map->reserved_size - gpa >= length);
+    void* addr = (reserved ? ivee_memory_map_reserved_hva(map, gpa) : reserve_aligned(length, backing_page_size(backing), gpa));
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    void* ptr = mmap(addr,
                      length,
                      (host_ro ? PROT_READ : PROT_READ | PROT_WRITE),
-                     MAP_SHARED | (mmap_fd == -1 ? MAP_ANONYMOUS : 0),
-                     mmap_fd,
-                     0);
+                     (map_private ? MAP_PRIVATE : MAP_SHARED) |
+                     (fd == -1 ? MAP_ANONYMOUS : 0) |
+                     (addr ? MAP_FIXED : 0),
+                     fd,
+                     fd_offset);
     if (ptr == MAP_FAILED) {
+        if (addr && !reserved) {
+            munmap(addr, length);
+        }
         return NULL;
     }
 
-    mr = ivee_alloc(sizeof(*mr));
+    if (backing == IVEE_MEMORY_SHARED_THP || backing == IVEE_MEMORY_PRIVATE_THP) {
+        /* Best effort, THP may be disabled on host */
+        madvise(ptr, length, MADV_HUGEPAGE);
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_alloc(sizeof(*mr));
     if (!mr) {
-        munmap(ptr, length);
+        release_host_memory(ptr, length, reserved);
         return NULL;
     }
 
@@ -63,38 +207,431 @@ struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* ma
     mr->prot = prot;
     mr->hva = ptr;
     mr->length = length;
+    mr->fd = fd;
+    mr->fd_offset = fd_offset;
+    mr->backing = backing;
+    mr->host_ro = host_ro;
+    mr->is_private = map_private && !host_ro; /* Contents can't diverge if we never write */
+    mr->log_dirty = false;
+    mr->snapshot_hva = NULL;
+    mr->user_owned = false;
+    mr->reserved = reserved;
+
+    insert_region(map, mr);
+    return mr;
+}
+
+/* Create memfd to back anonymous guest memory */
+static int create_memfd(enum ivee_memory_backing backing, size_t length)
+{
+    unsigned flags = MFD_CLOEXEC;
+    if (backing == IVEE_MEMORY_HUGETLB_2M) {
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    } else if (backing == IVEE_MEMORY_HUGETLB_1G) {
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+    }
+
+    int fd = memfd_create("ivee-guest-memory", flags);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(fd, length) != 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    return fd;
+}
+
+struct ivee_guest_memory_region* ivee_map_host_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      size_t length,
+                                                      int mmap_fd,
+                                                      off_t mmap_offset,
+                                                      bool host_ro,
+                                                      enum ivee_memory_backing backing,
+                                                      enum ivee_memory_prot prot)
+{
+    if (!map) {
+        return NULL;
+    }
+
+    if (!length) {
+        return NULL;
+    }
+
+    /*
+     * Keep our own reference to whatever backs the region.
+     * Anonymous memory is a memfd rather than MAP_ANONYMOUS, so that it can be cloned later.
+     */
+    int fd = -1;
+    bool map_private = false;
+    if (mmap_fd != -1) {
+        /* Backing is given to us, map it privately so that we never write to it */
+        if (mmap_offset & (X86_PAGE_SIZE - 1)) {
+            return NULL;
+        }
+
+        fd = fcntl(mmap_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            return NULL;
+        }
+
+        map_private = true;
+        backing = IVEE_MEMORY_SHARED;
+    } else if (backing == IVEE_MEMORY_PRIVATE_THP) {
+        map_private = true;
+    } else {
+        if (backing == IVEE_MEMORY_HUGETLB_2M || backing == IVEE_MEMORY_HUGETLB_1G) {
+            /* Hugetlb pages can't be split, so guest region has to be made of whole pages */
+            size_t page_size = backing_page_size(backing);
+            if ((gpa | length) & (page_size - 1)) {
+                backing = IVEE_MEMORY_SHARED;
+            }
+        }
+
+        length = (length + (X86_PAGE_SIZE - 1)) & ~(X86_PAGE_SIZE - 1);
+
+        fd = create_memfd(backing, length);
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+
+    struct ivee_guest_memory_region* mr = map_region(map,
+                                                     gpa,
+                                                     length,
+                                                     fd,
+                                                     (mmap_fd != -1 ? mmap_offset : 0),
+                                                     host_ro,
+                                                     map_private,
+                                                     backing,
+                                                     prot);
+    if (!mr) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    return mr;
+}
+
+struct ivee_guest_memory_region* ivee_map_user_memory(struct ivee_memory_map* map,
+                                                      gpa_t gpa,
+                                                      void* hva,
+                                                      size_t length,
+                                                      enum ivee_memory_prot prot)
+{
+    if (!map || !hva || !length) {
+        return NULL;
+    }
+
+    if (((uintptr_t)hva | gpa | length) & (X86_PAGE_SIZE - 1)) {
+        return NULL;
+    }
+
+    if (IVEE_GPA_LAST - gpa < length - 1) {
+        return NULL;
+    }
+
+    gpa_t first_gfn = gpa >> X86_PAGE_SHIFT;
+    gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
+    if (overlaps_region(map, first_gfn, last_gfn) || grow_regions(map) != 0) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_zalloc(sizeof(*mr));
+    if (!mr) {
+        return NULL;
+    }
+
+    mr->first_gfn = first_gfn;
+    mr->last_gfn = last_gfn;
+    mr->prot = prot;
+    mr->hva = hva;
+    mr->length = length;
+    mr->fd = -1;
+    mr->backing = IVEE_MEMORY_SHARED;
+    mr->host_ro = !(prot & IVEE_WRITE);
+    mr->user_owned = true;
+
+    insert_region(map, mr);
+    return mr;
+}
+
+struct ivee_guest_memory_region* ivee_clone_host_memory(struct ivee_memory_map* map,
+                                                        const struct ivee_guest_memory_region* src)
+{
+    if (!map || !src) {
+        return NULL;
+    }
+
+    /* Private view does not have its contents in the backing object */
+    if (src->is_private || src->fd < 0) {
+        return NULL;
+    }
+
+    int fd = fcntl(src->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = map_region(map,
+                                                     src->first_gfn << X86_PAGE_SHIFT,
+                                                     src->length,
+                                                     fd,
+                                                     src->fd_offset,
+                                                     src->host_ro,
+                                                     true,
+                                                     src->backing,
+                                                     src->prot);
+    if (!mr) {
+        close(fd);
+        return NULL;
+    }
 
-    LIST_INSERT_HEAD(&map->regions, mr, link);
     return mr;
 }
 
+/* Move current contents of a private view into a new backing object, so that region is a shared view of it again */
+static int copy_private_memory(struct ivee_guest_memory_region* mr)
+{
+    int fd = create_memfd(mr->backing, mr->length);
+    if (fd < 0) {
+        return fd;
+    }
+
+    void* copy = mmap(NULL, mr->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (copy == MAP_FAILED) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    memcpy(copy, mr->hva, mr->length);
+    munmap(copy, mr->length);
+
+    /* Private view stays in place until the caller remaps it from the new backing */
+    close(mr->fd);
+    mr->fd = fd;
+    mr->fd_offset = 0;
+    mr->is_private = false;
+    return 0;
+}
+
+int ivee_snapshot_host_memory(struct ivee_guest_memory_region* mr, bool diverged)
+{
+    if (!mr || mr->fd < 0) {
+        return -EINVAL;
+    }
+
+    if (mr->snapshot_hva) {
+        return 0;
+    }
+
+    if (mr->is_private && diverged) {
+        int res = copy_private_memory(mr);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    void* snapshot = mmap(NULL, mr->length, PROT_READ, MAP_SHARED, mr->fd, mr->fd_offset);
+    if (snapshot == MAP_FAILED) {
+        return -errno;
+    }
+
+    /* Replace shared mapping in place so that region HVA stays the same */
+    if (!mr->is_private) {
+        void* ptr = mmap(mr->hva,
+                         mr->length,
+                         (mr->host_ro ? PROT_READ : PROT_READ | PROT_WRITE),
+                         MAP_PRIVATE | MAP_FIXED,
+                         mr->fd,
+                         mr->fd_offset);
+        if (ptr == MAP_FAILED) {
+            int res = -errno;
+            munmap(snapshot, mr->length);
+            return res;
+        }
+
+        if (mr->backing == IVEE_MEMORY_SHARED_THP) {
+            madvise(ptr, mr->length, MADV_HUGEPAGE);
+        }
+
+        mr->is_private = true;
+    }
+
+    mr->snapshot_hva = snapshot;
+    return 0;
+}
+
+void ivee_restore_host_memory(struct ivee_guest_memory_region* mr, const uint64_t* bitmap)
+{
+    if (!mr || !mr->snapshot_hva || !bitmap) {
+        return;
+    }
+
+    size_t npages = mr->last_gfn - mr->first_gfn + 1;
+    for (size_t i = 0; i < (npages + 63) / 64; ++i) {
+        uint64_t bits = bitmap[i];
+        while (bits) {
+            /* Copy each run of consecutive dirty pages at once */
+            size_t first = __builtin_ctzll(bits);
+            uint64_t run = ~(bits >> first);
+            size_t count = (run ? (size_t)__builtin_ctzll(run) : 64 - first);
+            if (first + count == 64) {
+                bits = 0;
+            } else {
+                bits &= ~(((1ull << count) - 1) << first);
+            }
+
+            size_t offset = (i * 64 + first) << X86_PAGE_SHIFT;
+            memcpy((uint8_t*)mr->hva + offset, (const uint8_t*)mr->snapshot_hva + offset, count << X86_PAGE_SHIFT);
+        }
+    }
+}
+
+void ivee_drop_host_memory_snapshot(struct ivee_guest_memory_region* mr)
+{
+    if (!mr || !mr->snapshot_hva) {
+        return;
+    }
+
+    munmap(mr->snapshot_hva, mr->length);
+    mr->snapshot_hva = NULL;
+}
+
+/* Drop region from its memory map and free it, optionally leaving host memory to the caller */
+static void free_region(struct ivee_guest_memory_region* mr, bool release_memory)
+{
+    remove_region(mr->map, mr);
+
+    ivee_drop_host_memory_snapshot(mr);
+    if (release_memory && !mr->user_owned) {
+        release_host_memory(mr->hva, mr->length, mr->reserved);
+    }
+
+    if (mr->fd >= 0) {
+        close(mr->fd);
+    }
+
+    ivee_free(mr);
+}
+
 void ivee_unmap_host_memory(struct ivee_guest_memory_region* mr)
 {
     if (!mr || !mr->hva) {
         return;
     }
 
-    LIST_REMOVE(mr, link);
+    free_region(mr, true);
+}
 
-    munmap(mr->hva, mr->length);
-    ivee_free(mr);
+struct ivee_guest_memory_region* ivee_memory_map_lookup(struct ivee_memory_map* map, gpa_t gpa)
+{
+    if (!map || map->nregions == 0) {
+        return NULL;
+    }
+
+    gpa_t gfn = gpa >> X86_PAGE_SHIFT;
+
+    /* Map is never modified concurrently with lookups, hint is only a hint */
+    size_t index = atomic_load_explicit(&map->last_hit, memory_order_relaxed);
+    if (index < map->nregions && gfn >= map->regions[index]->first_gfn && gfn <= map->regions[index]->last_gfn) {
+        return map->regions[index];
+    }
+
+    index = upper_bound(map, gfn);
+    if (index == 0 || map->regions[index - 1]->last_gfn < gfn) {
+        return NULL;
+    }
+
+    atomic_store_explicit(&map->last_hit, index - 1, memory_order_relaxed);
+    return map->regions[index - 1];
 }
 
-int ivee_init_memory_map(struct ivee_memory_map* map)
+void* ivee_memory_map_hva(struct ivee_memory_map* map, gpa_t gpa, size_t length, enum ivee_memory_prot prot)
 {
-    LIST_INIT(&map->regions);
+    if (!map || !length || IVEE_GPA_LAST - gpa < length - 1) {
+        return NULL;
+    }
+
+    struct ivee_guest_memory_region* mr = ivee_memory_map_lookup(map, gpa);
+    if (!mr) {
+        return NULL;
+    }
+
+    gpa_t last_gfn = (gpa + (length - 1)) >> X86_PAGE_SHIFT;
+    if (last_gfn > mr->last_gfn || (mr->prot & prot) != prot || ((prot & IVEE_WRITE) && mr->host_ro)) {
+        return NULL;
+    }
+
+    /* Guest RAM is found by an add, only buffers have their own host addresses */
+    if (mr->reserved) {
+        return ivee_memory_map_reserved_hva(map, gpa);
+    }
+
+    return (uint8_t*)mr->hva + (gpa - (mr->first_gfn << X86_PAGE_SHIFT));
+}
+
+int ivee_init_memory_map(struct ivee_memory_map* map, size_t size)
+{
+    map->regions = NULL;
+    map->nregions = 0;
+    map->capacity = 0;
+    atomic_init(&map->last_hit, 0);
+    map->reserved_base = NULL;
+    map->reserved_size = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    uint8_t* ptr = reserve_aligned(size, HUGE_PAGE_SIZE_1G, 0);
+    if (ptr == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    map->reserved_base = ptr;
+    map->reserved_size = size;
     return 0;
 }
 
+void ivee_clear_memory_map(struct ivee_memory_map* map)
+{
+    if (!map) {
+        return;
+    }
+
+    /* Going from the end saves moving the rest of regions around */
+    while (map->nregions > 0) {
+        ivee_unmap_host_memory(map->regions[map->nregions - 1]);
+    }
+}
+
 void ivee_free_memory_map(struct ivee_memory_map* map)
 {
     if (!map) {
         return;
     }
 
-    struct ivee_guest_memory_region* mr;
-    while (!LIST_EMPTY(&map->regions)) {
-        mr = LIST_FIRST(&map->regions);
-        ivee_unmap_host_memory(mr);
+    /* Whole reservation goes at once, regions inside of it only have to let go of their objects */
+    if (map->reserved_base) {
+        munmap(map->reserved_base, map->reserved_size);
     }
+
+    while (map->nregions > 0) {
+        struct ivee_guest_memory_region* mr = map->regions[map->nregions - 1];
+        free_region(mr, !mr->reserved);
+    }
+
+    ivee_free(map->regions);
+    map->regions = NULL;
+    map->capacity = 0;
+    map->reserved_base = NULL;
+    map->reserved_size = 0;
 }
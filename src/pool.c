@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+
+/*
+ * Pool is organized as a set of small per-thread magazines in front of a shared depot.
+ *
+ * Each thread is assigned to one of IVEE_POOL_CACHES cache slots. A slot holds a magazine of
+ * up to IVEE_POOL_MAGAZINE_SIZE environments which the thread claims with a single atomic exchange,
+ * so in steady state acquire/release never touch the depot lock.
+ * If the slot is taken by another thread sharing it we just go to the depot.
+ *
+ * Depot is a mutex-protected stack sized to hold every environment the pool can own,
+ * magazines spill half of their contents there when full and refill from it when empty.
+ */
+
+#define IVEE_POOL_MAGAZINE_SIZE 8
+#define IVEE_POOL_CACHES        16
+
+struct ivee_pool_magazine
+{
+    size_t count;
+    struct ivee* rounds[IVEE_POOL_MAGAZINE_SIZE];
+};
+
+struct ivee_pool_cache
+{
+    /* Magazine owned by this slot, NULL while some thread is using it */
+    _Atomic(struct ivee_pool_magazine*) magazine;
+} __attribute__((aligned(64)));
+
+struct ivee_pool
+{
+    /* Per-thread magazine slots */
+    struct ivee_pool_cache caches[IVEE_POOL_CACHES];
+
+    /* Magazine storage for cache slots */
+    struct ivee_pool_magazine magazines[IVEE_POOL_CACHES];
+
+    /* Environment parameters for new instances */
+    enum ivee_capabilities caps;
+    struct ivee_image* image;
+
+    /* Maximum number of owned environments */
+    size_t max;
+
+    /* Number of currently owned environments, acquired or not */
+    atomic_size_t total;
+
+    /* Depot of free environments */
+    pthread_mutex_t lock;
+    size_t depot_count;
+    struct ivee** depot;
+};
+
+/* Next cache slot to hand out to a thread */
+static atomic_uint g_next_cache_index;
+
+static struct ivee_pool_cache* this_thread_cache(struct ivee_pool* pool)
+{
+    static _Thread_local unsigned cache_index = UINT32_MAX;
+    if (cache_index == UINT32_MAX) {
+        cache_index = atomic_fetch_add_explicit(&g_next_cache_index, 1, memory_order_relaxed) % IVEE_POOL_CACHES;
+    }
+
+    return &pool->caches[cache_index];
+}
+
+static int create_instance(struct ivee_pool* pool, struct ivee** out_ivee)
+{
+    /* Reserve our spot first so that concurrent creators can't go over the limit */
+    size_t total = atomic_fetch_add(&pool->total, 1);
+    if (total >= pool->max) {
+        atomic_fetch_sub(&pool->total, 1);
+        return -EAGAIN;
+    }
+
+    struct ivee* ivee = NULL;
+    int res = ivee_create(pool->caps, &ivee);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    res = ivee_load_image(ivee, pool->image);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    *out_ivee = ivee;
+    return 0;
+
+error_out:
+    ivee_destroy(ivee);
+    atomic_fetch_sub(&pool->total, 1);
+    return res;
+}
+
+/* Move up to count environments from depot into magazine */
+static void depot_get(struct ivee_pool* pool, struct ivee_pool_magazine* mag, size_t count)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (count-- > 0 && pool->depot_count > 0 && mag->count < IVEE_POOL_MAGAZINE_SIZE) {
+        mag->rounds[mag->count++] = pool->depot[--pool->depot_count];
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Move up to count environments from magazine into depot */
+static void depot_put(struct ivee_pool* pool, struct ivee_pool_magazine* mag, size_t count)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (count-- > 0 && mag->count > 0) {
+        pool->depot[pool->depot_count++] = mag->rounds[--mag->count];
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int ivee_pool_create(enum ivee_capabilities caps,
+                     const char* file,
+                     enum ivee_executable_format format,
+                     size_t min,
+                     size_t max,
+                     struct ivee_pool** out_pool)
+{
+    int res = 0;
+
+    if (!file || !out_pool) {
+        return -EINVAL;
+    }
+
+    if (max == 0 || min > max) {
+        return -EINVAL;
+    }
+
+    struct ivee_pool* pool = ivee_zalloc(sizeof(*pool));
+    if (!pool) {
+        return -ENOMEM;
+    }
+
+    res = pthread_mutex_init(&pool->lock, NULL);
+    if (res != 0) {
+        ivee_free(pool);
+        return -res;
+    }
+
+    for (size_t i = 0; i < IVEE_POOL_CACHES; ++i) {
+        atomic_init(&pool->caches[i].magazine, &pool->magazines[i]);
+    }
+
+    atomic_init(&pool->total, 0);
+    pool->caps = caps;
+    pool->max = max;
+
+    /* Parse executable once for all instances */
+    res = ivee_image_open(file, format, &pool->image);
+    if (res != 0) {
+        goto error_out;
+    }
+
+    pool->depot = ivee_zalloc(max * sizeof(*pool->depot));
+    if (!pool->depot) {
+        res = -ENOMEM;
+        goto error_out;
+    }
+
+    while (pool->depot_count < min) {
+        res = create_instance(pool, &pool->depot[pool->depot_count]);
+        if (res != 0) {
+            goto error_out;
+        }
+
+        ++pool->depot_count;
+    }
+
+    *out_pool = pool;
+    return 0;
+
+error_out:
+    ivee_pool_destroy(pool);
+    return res;
+}
+
+void ivee_pool_destroy(struct ivee_pool* pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    for (size_t i = 0; i < IVEE_POOL_CACHES; ++i) {
+        struct ivee_pool_magazine* mag = &pool->magazines[i];
+        while (mag->count > 0) {
+            ivee_destroy(mag->rounds[--mag->count]);
+        }
+    }
+
+    while (pool->depot_count > 0) {
+        ivee_destroy(pool->depot[--pool->depot_count]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    ivee_free(pool->depot);
+    ivee_image_close(pool->image);
+    ivee_free(pool);
+}
+
+int ivee_pool_acquire(struct ivee_pool* pool, struct ivee** out_ivee)
+{
+    if (!pool || !out_ivee) {
+        return -EINVAL;
+    }
+
+    struct ivee_pool_cache* cache = this_thread_cache(pool);
+    struct ivee_pool_magazine* mag = atomic_exchange_explicit(&cache->magazine, NULL, memory_order_acquire);
+    if (mag) {
+        if (mag->count == 0) {
+            depot_get(pool, mag, IVEE_POOL_MAGAZINE_SIZE / 2);
+        }
+
+        struct ivee* ivee = (mag->count > 0 ? mag->rounds[--mag->count] : NULL);
+        atomic_store_explicit(&cache->magazine, mag, memory_order_release);
+
+        if (ivee) {
+            *out_ivee = ivee;
+            return 0;
+        }
+    } else {
+        /* Slot is busy, fall back to depot */
+        struct ivee_pool_magazine tmp = { .count = 0 };
+        depot_get(pool, &tmp, 1);
+        if (tmp.count > 0) {
+            *out_ivee = tmp.rounds[0];
+            return 0;
+        }
+    }
+
+    return create_instance(pool, out_ivee);
+}
+
+void ivee_pool_release(struct ivee_pool* pool, struct ivee* ivee)
+{
+    if (!pool || !ivee) {
+        return;
+    }
+
+    struct ivee_pool_cache* cache = this_thread_cache(pool);
+    struct ivee_pool_magazine* mag = atomic_exchange_explicit(&cache->magazine, NULL, memory_order_acquire);
+    if (mag) {
+        if (mag->count == IVEE_POOL_MAGAZINE_SIZE) {
+            depot_put(pool, mag, IVEE_POOL_MAGAZINE_SIZE / 2);
+        }
+
+        mag->rounds[mag->count++] = ivee;
+        atomic_store_explicit(&cache->magazine, mag, memory_order_release);
+    } else {
+        struct ivee_pool_magazine tmp = { .count = 1, .rounds = { ivee } };
+        depot_put(pool, &tmp, 1);
+    }
+}
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libivee/libivee.h"
+#include "platform.h"
+#include "service.h"
+#include "x86.h"
+#include "ivee.h"
+
+/*
+ * Service loop is a single long-running call into the environment made by a thread of its own.
+ * Guest polls a request ring in its memory, so a request and its completion only go through
+ * shared memory while both sides are busy. Either side sleeps only after telling the other one:
+ * guest halts, which exits to the vcpu thread, and host threads wait on futexes guest asks
+ * vcpu thread to wake with a port write.
+ */
+
+/* Poll for completions this many times before going to sleep */
+#define SERVICE_SPIN_COUNT 4096
+
+struct ivee_service
+{
+    /* Environment running the loop */
+    struct ivee* ivee;
+
+    /* Request ring in guest memory */
+    struct ivee_service_ring* ring;
+
+    /* Thread running the loop */
+    pthread_t thread;
+
+    /* Guest state to start with, final guest state once the loop finished */
+    struct ivee_arch_state state;
+
+    /* Call result, valid once finished is set */
+    int result;
+    atomic_bool finished;
+
+    /* How long host polls for completions, 0 if guest can't make progress meanwhile */
+    int spin_count;
+
+    /* Requests submitted by host, head index of the oldest one not collected yet */
+    uint32_t collected;
+
+    /*
+     * Futex words: bumped whenever vcpu thread sleeping in guest halt or host thread waiting
+     * for completions should recheck what they are waiting for.
+     * Ring indices can't be used for this, guest writes to them don't wake anyone.
+     */
+    uint32_t idle_seq;
+    uint32_t complete_seq;
+};
+
+#define RING_LOAD(field) __atomic_load_n(&svc->ring->field, __ATOMIC_ACQUIRE)
+#define RING_STORE(field, val) __atomic_store_n(&svc->ring->field, (val), __ATOMIC_RELEASE)
+
+static void bump_and_wake(uint32_t* seq)
+{
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    ivee_futex_wake(seq);
+}
+
+static void* service_thread(void* arg)
+{
+    struct ivee_service* svc = arg;
+
+    svc->result = ivee_call(svc->ivee, &svc->state);
+    atomic_store_explicit(&svc->finished, true, memory_order_release);
+
+    /* Host might be waiting for a completion that is never coming */
+    bump_and_wake(&svc->complete_seq);
+    return NULL;
+}
+
+int ivee_service_start(struct ivee* ivee,
+                       uint64_t ring_gpa,
+                       const struct ivee_arch_state* state,
+                       struct ivee_service** out_svc)
+{
+    int res = 0;
+
+    if (!ivee || !state || !out_svc || (ring_gpa & (X86_PAGE_SIZE - 1))) {
+        return -EINVAL;
+    }
+
+    if (!ivee->gpt_mr) {
+        return -EINVAL;
+    }
+
+    if (ivee->service) {
+        return -EBUSY;
+    }
+
+    struct ivee_service_ring* ring = ivee_memory_map_hva(&ivee->memory_map, ring_gpa, sizeof(*ring),
+                                                         IVEE_READ | IVEE_WRITE);
+    if (!ring) {
+        return -EFAULT;
+    }
+
+    struct ivee_service* svc = ivee_zalloc(sizeof(*svc));
+    if (!svc) {
+        return -ENOMEM;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    svc->ivee = ivee;
+    svc->ring = ring;
+    svc->state = *state;
+    svc->state.rdi = ring_gpa;
+
+    /* With a single cpu polling only delays the guest */
+    svc->spin_count = (sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SERVICE_SPIN_COUNT : 0);
+
+    pthread_mutex_lock(&ivee->kick_lock);
+    ivee->service = svc;
+    pthread_mutex_unlock(&ivee->kick_lock);
+
+    /* Same as async worker, vcpu thread only gets kick signals while in the guest */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = -pthread_create(&svc->thread, NULL, service_thread, svc);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (res != 0) {
+        pthread_mutex_lock(&ivee->kick_lock);
+        ivee->service = NULL;
+        pthread_mutex_unlock(&ivee->kick_lock);
+        ivee_free(svc);
+        return res;
+    }
+
+    *out_svc = svc;
+    return 0;
+}
+
+/* Wake guest if it went idle after we have posted something for it */
+static void wake_guest(struct ivee_service* svc)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (RING_LOAD(guest_idle)) {
+        bump_and_wake(&svc->idle_seq);
+    }
+}
+
+int ivee_service_submit(struct ivee_service* svc, uint64_t op, const uint64_t args[IVEE_HYPERCALL_ARGS])
+{
+    if (!svc || !args) {
+        return -EINVAL;
+    }
+
+    if (atomic_load_explicit(&svc->finished, memory_order_acquire)) {
+        return -EPIPE;
+    }
+
+    /* Slots are reused only after host has collected their results */
+    uint32_t head = svc->ring->head;
+    if (head - svc->collected == IVEE_SERVICE_RING_ENTRIES) {
+        return -EAGAIN;
+    }
+
+    struct ivee_service_request* req = &svc->ring->requests[head % IVEE_SERVICE_RING_ENTRIES];
+    req->op = op;
+    memcpy(req->args, args, sizeof(req->args));
+    req->result = 0;
+
+    RING_STORE(head, head + 1);
+    wake_guest(svc);
+    return 0;
+}
+
+int ivee_service_complete(struct ivee_service* svc, uint64_t* result)
+{
+    if (!svc || !result) {
+        return -EINVAL;
+    }
+
+    uint32_t seq = svc->collected;
+    if (seq == svc->ring->head) {
+        return -ENOENT;
+    }
+
+    /* Index difference tells if request seq is completed regardless of wraparound */
+    uint32_t tail = RING_LOAD(tail);
+    for (int i = 0; (int32_t)(tail - seq) <= 0 && i < svc->spin_count; ++i) {
+        ivee_cpu_relax();
+        tail = RING_LOAD(tail);
+    }
+
+    while ((int32_t)(tail - seq) <= 0) {
+        uint32_t wake_seq = __atomic_load_n(&svc->complete_seq, __ATOMIC_SEQ_CST);
+        RING_STORE(host_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        tail = RING_LOAD(tail);
+        if ((int32_t)(tail - seq) <= 0) {
+            if (atomic_load_explicit(&svc->finished, memory_order_acquire)) {
+                RING_STORE(host_waiting, 0);
+                return -EPIPE;
+            }
+
+            ivee_futex_wait(&svc->complete_seq, wake_seq);
+            tail = RING_LOAD(tail);
+        }
+
+        RING_STORE(host_waiting, 0);
+    }
+
+    *result = svc->ring->requests[seq % IVEE_SERVICE_RING_ENTRIES].result;
+    svc->collected = seq + 1;
+    return 0;
+}
+
+int ivee_service_call(struct ivee_service* svc, uint64_t op, const uint64_t args[IVEE_HYPERCALL_ARGS], uint64_t* result)
+{
+    if (!result) {
+        return -EINVAL;
+    }
+
+    int res = ivee_service_submit(svc, op, args);
+    if (res != 0) {
+        return res;
+    }
+
+    /* Collect everything submitted before, ours is the last one */
+    do {
+        res = ivee_service_complete(svc, result);
+    } while (res == 0 && svc->collected != svc->ring->head);
+
+    return res;
+}
+
+int ivee_service_stop(struct ivee_service* svc, struct ivee_arch_state* state)
+{
+    if (!svc) {
+        return -EINVAL;
+    }
+
+    struct ivee* ivee = svc->ivee;
+
+    RING_STORE(stop, 1);
+    wake_guest(svc);
+    pthread_join(svc->thread, NULL);
+
+    pthread_mutex_lock(&ivee->kick_lock);
+    ivee->service = NULL;
+    pthread_mutex_unlock(&ivee->kick_lock);
+
+    int res = svc->result;
+    if (state) {
+        *state = svc->state;
+    }
+
+    ivee_free(svc);
+    return res;
+}
+
+void ivee_service_destroy(struct ivee_service* svc)
+{
+    ivee_service_stop(svc, NULL);
+}
+
+void ivee_service_idle(struct ivee_service* svc)
+{
+    uint32_t wake_seq = __atomic_load_n(&svc->idle_seq, __ATOMIC_SEQ_CST);
+    if (RING_LOAD(head) == RING_LOAD(tail) && !RING_LOAD(stop)) {
+        ivee_futex_wait(&svc->idle_seq, wake_seq);
+    }
+}
+
+void ivee_service_notify(struct ivee_service* svc)
+{
+    bump_and_wake(&svc->complete_seq);
+}
+
+void ivee_service_kick(struct ivee_service* svc)
+{
+    bump_and_wake(&svc->idle_seq);
+}
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libivee/libivee.h"
+#include "stats.h"
+
+/*
+ * Global aggregate is made of counters of destroyed instances plus counters of live ones.
+ * Instances only take the lock on creation and destruction, calls don't touch any shared state.
+ */
+static struct {
+    pthread_mutex_t lock;
+    LIST_HEAD(, ivee_instance_stats) instances;
+    struct ivee_stats retired;
+} g_stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void add_stats(struct ivee_stats* dst, const struct ivee_stats* src)
+{
+    dst->calls += src->calls;
+    dst->failed_calls += src->failed_calls;
+    dst->runs += src->runs;
+    dst->io_exits += src->io_exits;
+    dst->unknown_exits += src->unknown_exits;
+    dst->interrupted_exits += src->interrupted_exits;
+    dst->hlt_exits += src->hlt_exits;
+    dst->pio_other_exits += src->pio_other_exits;
+    dst->run_cycles += src->run_cycles;
+    dst->host_cycles += src->host_cycles;
+
+    if (dst->tsc_khz == 0) {
+        dst->tsc_khz = src->tsc_khz;
+    }
+
+    for (size_t i = 0; i < IVEE_STATS_PIO_PORTS && src->pio_ports[i].exits > 0; ++i) {
+        size_t j = 0;
+        while (j < IVEE_STATS_PIO_PORTS &&
+               dst->pio_ports[j].exits > 0 &&
+               dst->pio_ports[j].port != src->pio_ports[i].port) {
+            ++j;
+        }
+
+        if (j == IVEE_STATS_PIO_PORTS) {
+            dst->pio_other_exits += src->pio_ports[i].exits;
+        } else {
+            dst->pio_ports[j].port = src->pio_ports[i].port;
+            dst->pio_ports[j].exits += src->pio_ports[i].exits;
+        }
+    }
+
+    for (size_t i = 0; i < IVEE_STATS_HISTOGRAM_BUCKETS; ++i) {
+        dst->call_cycles[i] += src->call_cycles[i];
+    }
+}
+
+void ivee_stats_register(struct ivee_instance_stats* stats)
+{
+    memset(&stats->counters, 0, sizeof(stats->counters));
+
+    pthread_mutex_lock(&g_stats.lock);
+    LIST_INSERT_HEAD(&g_stats.instances, stats, link);
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+void ivee_stats_unregister(struct ivee_instance_stats* stats)
+{
+    pthread_mutex_lock(&g_stats.lock);
+    LIST_REMOVE(stats, link);
+    add_stats(&g_stats.retired, &stats->counters);
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+int ivee_get_global_stats(struct ivee_stats* stats)
+{
+    if (!stats) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+
+    *stats = g_stats.retired;
+
+    struct ivee_instance_stats* instance;
+    LIST_FOREACH(instance, &g_stats.instances, link) {
+        add_stats(stats, &instance->counters);
+    }
+
+    pthread_mutex_unlock(&g_stats.lock);
+    return 0;
+}
+
+uint64_t ivee_stats_bucket_cycles(size_t bucket)
+{
+    if (bucket < 8) {
+        return bucket;
+    }
+
+    if (bucket >= IVEE_STATS_HISTOGRAM_BUCKETS) {
+        return UINT64_MAX;
+    }
+
+    /* Inverse of ivee_stats_bucket */
+    unsigned shift = bucket / 8 - 1;
+    return (8 + bucket % 8) << shift;
+}
+
+uint64_t ivee_stats_percentile(const struct ivee_stats* stats, double percentile)
+{
+    if (!stats || stats->calls == 0) {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < IVEE_STATS_HISTOGRAM_BUCKETS; ++i) {
+        total += stats->call_cycles[i];
+    }
+
+    /* Rank of the sample we're looking for, 1-based */
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > total) {
+        rank = total;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < IVEE_STATS_HISTOGRAM_BUCKETS; ++i) {
+        seen += stats->call_cycles[i];
+        if (seen >= rank) {
+            return ivee_stats_bucket_cycles(i);
+        }
+    }
+
+    return 0;
+}
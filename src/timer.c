@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "platform.h"
+#include "timer.h"
+
+/*
+ * All deadlines are served by a single thread sleeping until the earliest one in a binary min-heap.
+ * Arming and disarming timers only takes the heap lock, the thread is woken up only when
+ * a deadline comes before the one it sleeps until. Disarmed deadlines are not chased:
+ * thread wakes up at them and goes back to sleep, which is at most one wakeup per deadline it slept until.
+ */
+
+#define IVEE_TIMER_NOT_ARMED SIZE_MAX
+
+static struct {
+    pthread_once_t once;
+    int init_res;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    size_t count;
+    size_t capacity;
+    struct ivee_timer** heap;
+
+    /* Deadline timer thread sleeps until, UINT64_MAX if it waits for timers to be armed */
+    uint64_t sleeping_until;
+} g_timers = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sleeping_until = UINT64_MAX,
+};
+
+uint64_t ivee_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void heap_set(size_t index, struct ivee_timer* timer)
+{
+    g_timers.heap[index] = timer;
+    timer->heap_index = index;
+}
+
+static void heap_sift_up(size_t index)
+{
+    struct ivee_timer* timer = g_timers.heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (g_timers.heap[parent]->deadline <= timer->deadline) {
+            break;
+        }
+
+        heap_set(index, g_timers.heap[parent]);
+        index = parent;
+    }
+
+    heap_set(index, timer);
+}
+
+static void heap_sift_down(size_t index)
+{
+    struct ivee_timer* timer = g_timers.heap[index];
+    while (true) {
+        size_t child = index * 2 + 1;
+        if (child >= g_timers.count) {
+            break;
+        }
+
+        if (child + 1 < g_timers.count && g_timers.heap[child + 1]->deadline < g_timers.heap[child]->deadline) {
+            ++child;
+        }
+
+        if (timer->deadline <= g_timers.heap[child]->deadline) {
+            break;
+        }
+
+        heap_set(index, g_timers.heap[child]);
+        index = child;
+    }
+
+    heap_set(index, timer);
+}
+
+static void heap_remove(struct ivee_timer* timer)
+{
+    size_t index = timer->heap_index;
+    struct ivee_timer* last = g_timers.heap[--g_timers.count];
+    timer->heap_index = IVEE_TIMER_NOT_ARMED;
+
+    if (last == timer) {
+        return;
+    }
+
+    heap_set(index, last);
+    heap_sift_up(index);
+    heap_sift_down(last->heap_index);
+}
+
+static void* timer_thread(void* arg)
+{
+    pthread_mutex_lock(&g_timers.lock);
+
+    while (true) {
+        if (g_timers.count == 0) {
+            g_timers.sleeping_until = UINT64_MAX;
+            pthread_cond_wait(&g_timers.cond, &g_timers.lock);
+            continue;
+        }
+
+        uint64_t now = ivee_monotonic_ns();
+        struct ivee_timer* timer = g_timers.heap[0];
+        if (timer->deadline <= now) {
+            heap_remove(timer);
+            timer->expire(timer);
+            continue;
+        }
+
+        struct timespec ts = {
+            .tv_sec = timer->deadline / 1000000000ull,
+            .tv_nsec = timer->deadline % 1000000000ull,
+        };
+
+        g_timers.sleeping_until = timer->deadline;
+        pthread_cond_timedwait(&g_timers.cond, &g_timers.lock, &ts);
+    }
+
+    return NULL;
+}
+
+static void init_timers(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_timers.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* Timer thread lives as long as the process, keep process signals away from it */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t thread;
+    g_timers.init_res = -pthread_create(&thread, NULL, timer_thread, NULL);
+    if (g_timers.init_res == 0) {
+        pthread_detach(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int ivee_timer_start(struct ivee_timer* timer, uint64_t deadline)
+{
+    pthread_once(&g_timers.once, init_timers);
+    if (g_timers.init_res != 0) {
+        return g_timers.init_res;
+    }
+
+    pthread_mutex_lock(&g_timers.lock);
+
+    if (g_timers.count == g_timers.capacity) {
+        size_t capacity = (g_timers.capacity ? g_timers.capacity * 2 : 64);
+        struct ivee_timer** heap = ivee_realloc(g_timers.heap, capacity * sizeof(*heap));
+        if (!heap) {
+            pthread_mutex_unlock(&g_timers.lock);
+            return -ENOMEM;
+        }
+
+        g_timers.heap = heap;
+        g_timers.capacity = capacity;
+    }
+
+    timer->deadline = deadline;
+    heap_set(g_timers.count++, timer);
+    heap_sift_up(timer->heap_index);
+
+    /* Thread wakes up in time for this one anyway */
+    if (deadline < g_timers.sleeping_until) {
+        g_timers.sleeping_until = deadline;
+        pthread_cond_signal(&g_timers.cond);
+    }
+
+    pthread_mutex_unlock(&g_timers.lock);
+    return 0;
+}
+
+void ivee_timer_stop(struct ivee_timer* timer)
+{
+    pthread_mutex_lock(&g_timers.lock);
+
+    /* Timer might have expired already */
+    if (timer->heap_index != IVEE_TIMER_NOT_ARMED) {
+        heap_remove(timer);
+    }
+
+    pthread_mutex_unlock(&g_timers.lock);
+}
@@ -0,0 +1,172 @@
+#include <cpuid.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "libivee/libivee.h"
+#include "xsave.h"
+
+/* Offsets of extended state components in standard format, from CPUID leaf 0xD. 0 if not supported. */
+static uint32_t g_xfeature_offsets[X86_XFEATURE_HI16_ZMM + 1];
+static pthread_once_t g_xfeature_once = PTHREAD_ONCE_INIT;
+
+static void init_xfeature_offsets(void)
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    /* Supported user state components are reported in EDX:EAX */
+    uint64_t supported = ((uint64_t)edx << 32) | eax;
+    for (unsigned f = X86_XFEATURE_YMM; f <= X86_XFEATURE_HI16_ZMM; ++f) {
+        if (!(supported & X86_XFEATURE_MASK(f))) {
+            continue;
+        }
+
+        __get_cpuid_count(0xD, f, &eax, &ebx, &ecx, &edx);
+        g_xfeature_offsets[f] = ebx;
+    }
+}
+
+/* Effective register classes: wider vector classes include narrower ones */
+static bool has_xmm(uint32_t mask)
+{
+    return mask & (IVEE_ARCH_STATE_XMM | IVEE_ARCH_STATE_YMM | IVEE_ARCH_STATE_ZMM);
+}
+
+static bool has_ymm(uint32_t mask)
+{
+    return mask & (IVEE_ARCH_STATE_YMM | IVEE_ARCH_STATE_ZMM);
+}
+
+static bool has_zmm(uint32_t mask)
+{
+    return mask & IVEE_ARCH_STATE_ZMM;
+}
+
+uint64_t ivee_xsave_features(uint32_t mask)
+{
+    pthread_once(&g_xfeature_once, init_xfeature_offsets);
+
+    uint64_t features = 0;
+    if (has_xmm(mask)) {
+        features |= X86_XFEATURE_MASK(X86_XFEATURE_SSE);
+    }
+
+    if (has_ymm(mask)) {
+        features |= X86_XFEATURE_MASK(X86_XFEATURE_YMM);
+    }
+
+    if (has_zmm(mask)) {
+        features |= X86_XFEATURE_MASK(X86_XFEATURE_OPMASK) |
+                    X86_XFEATURE_MASK(X86_XFEATURE_ZMM_HI256) |
+                    X86_XFEATURE_MASK(X86_XFEATURE_HI16_ZMM);
+    }
+
+    for (unsigned f = X86_XFEATURE_YMM; f <= X86_XFEATURE_HI16_ZMM; ++f) {
+        if ((features & X86_XFEATURE_MASK(f)) && g_xfeature_offsets[f] == 0) {
+            return 0;
+        }
+    }
+
+    return features;
+}
+
+/*
+ * Register pieces live in different components:
+ * - xmm0-15 and MXCSR in the legacy region
+ * - bits 128-255 of ymm0-15 in YMM component
+ * - bits 256-511 of zmm0-15 in ZMM_Hi256, whole zmm16-31 in Hi16_ZMM, k0-7 in opmask component
+ */
+
+void ivee_xsave_put(void* area, const struct ivee_arch_state_ext* ext)
+{
+    uint8_t* xsave = area;
+    uint64_t xstate_bv;
+    memcpy(&xstate_bv, xsave + X86_XSAVE_XSTATE_BV_OFFSET, sizeof(xstate_bv));
+
+    if (has_xmm(ext->mask)) {
+        for (size_t i = 0; i < 16; ++i) {
+            memcpy(xsave + X86_XSAVE_XMM_OFFSET + i * 16, &ext->zmm[i][0], 16);
+        }
+
+        /* Zero is a valid but hardly ever wanted MXCSR, treat it as "don't care" */
+        if (ext->mxcsr) {
+            memcpy(xsave + X86_XSAVE_MXCSR_OFFSET, &ext->mxcsr, sizeof(ext->mxcsr));
+        }
+
+        xstate_bv |= X86_XFEATURE_MASK(X86_XFEATURE_SSE);
+    }
+
+    if (has_ymm(ext->mask)) {
+        uint8_t* ymm = xsave + g_xfeature_offsets[X86_XFEATURE_YMM];
+        for (size_t i = 0; i < 16; ++i) {
+            memcpy(ymm + i * 16, &ext->zmm[i][16], 16);
+        }
+
+        xstate_bv |= X86_XFEATURE_MASK(X86_XFEATURE_YMM);
+    }
+
+    if (has_zmm(ext->mask)) {
+        uint8_t* zmm_hi256 = xsave + g_xfeature_offsets[X86_XFEATURE_ZMM_HI256];
+        uint8_t* hi16_zmm = xsave + g_xfeature_offsets[X86_XFEATURE_HI16_ZMM];
+        for (size_t i = 0; i < 16; ++i) {
+            memcpy(zmm_hi256 + i * 32, &ext->zmm[i][32], 32);
+            memcpy(hi16_zmm + i * 64, &ext->zmm[16 + i][0], 64);
+        }
+
+        memcpy(xsave + g_xfeature_offsets[X86_XFEATURE_OPMASK], ext->k, sizeof(ext->k));
+
+        xstate_bv |= X86_XFEATURE_MASK(X86_XFEATURE_OPMASK) |
+                     X86_XFEATURE_MASK(X86_XFEATURE_ZMM_HI256) |
+                     X86_XFEATURE_MASK(X86_XFEATURE_HI16_ZMM);
+    }
+
+    memcpy(xsave + X86_XSAVE_XSTATE_BV_OFFSET, &xstate_bv, sizeof(xstate_bv));
+}
+
+/* Copy component data unless it is in init state */
+static void get_component(const uint8_t* src, uint64_t xstate_bv, unsigned feature, void* dst, size_t size)
+{
+    if (xstate_bv & X86_XFEATURE_MASK(feature)) {
+        memcpy(dst, src, size);
+    } else {
+        memset(dst, 0, size);
+    }
+}
+
+void ivee_xsave_get(const void* area, struct ivee_arch_state_ext* ext)
+{
+    const uint8_t* xsave = area;
+    uint64_t xstate_bv;
+    memcpy(&xstate_bv, xsave + X86_XSAVE_XSTATE_BV_OFFSET, sizeof(xstate_bv));
+
+    if (has_xmm(ext->mask)) {
+        for (size_t i = 0; i < 16; ++i) {
+            get_component(xsave + X86_XSAVE_XMM_OFFSET + i * 16, xstate_bv, X86_XFEATURE_SSE, &ext->zmm[i][0], 16);
+        }
+
+        /* MXCSR is always valid */
+        memcpy(&ext->mxcsr, xsave + X86_XSAVE_MXCSR_OFFSET, sizeof(ext->mxcsr));
+    }
+
+    if (has_ymm(ext->mask)) {
+        const uint8_t* ymm = xsave + g_xfeature_offsets[X86_XFEATURE_YMM];
+        for (size_t i = 0; i < 16; ++i) {
+            get_component(ymm + i * 16, xstate_bv, X86_XFEATURE_YMM, &ext->zmm[i][16], 16);
+        }
+    }
+
+    if (has_zmm(ext->mask)) {
+        const uint8_t* zmm_hi256 = xsave + g_xfeature_offsets[X86_XFEATURE_ZMM_HI256];
+        const uint8_t* hi16_zmm = xsave + g_xfeature_offsets[X86_XFEATURE_HI16_ZMM];
+        for (size_t i = 0; i < 16; ++i) {
+            get_component(zmm_hi256 + i * 32, xstate_bv, X86_XFEATURE_ZMM_HI256, &ext->zmm[i][32], 32);
+            get_component(hi16_zmm + i * 64, xstate_bv, X86_XFEATURE_HI16_ZMM, &ext->zmm[16 + i][0], 64);
+        }
+
+        get_component(xsave + g_xfeature_offsets[X86_XFEATURE_OPMASK],
+                      xstate_bv, X86_XFEATURE_OPMASK, ext->k, sizeof(ext->k));
+    }
+}
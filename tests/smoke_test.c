@@ -2,7 +2,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <limits.h>
+#include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
@@ -47,6 +50,854 @@ static void elf64_smoke_test(void)
     smoke_test("smoke_test_payload.elf64", IVEE_EXEC_ELF64);
 }
 
+/*
+ * Clone smoke test: call into a template and a couple of its clones
+ */
+static void clone_smoke_test(void)
+{
+    int res = 0;
+    ivee_t* template = NULL;
+    ivee_t* clone[2] = { NULL };
+
+    res = ivee_create(0, &template);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(template, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = {
+        .rcx = 1,
+        .rdx = 2,
+    };
+
+    res = ivee_call(template, &state);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (size_t i = 0; i < 2; ++i) {
+        res = ivee_clone(template, &clone[i]);
+        CU_ASSERT_TRUE(res == 0);
+
+        state.rcx = i;
+        state.rdx = 0xDEADF00Dul;
+        res = ivee_call(clone[i], &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, i + 0xDEADF00Dul);
+    }
+
+    /* Clones can't be cloned */
+    ivee_t* nested = NULL;
+    res = ivee_clone(clone[0], &nested);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    ivee_destroy(clone[0]);
+    ivee_destroy(clone[1]);
+    ivee_destroy(template);
+}
+
+/*
+ * Reset test: guest increments a counter in its memory, which should only persist without resets
+ */
+static uint64_t call_counter(ivee_t* ivee)
+{
+    ivee_arch_state_t state = { 0 };
+    int res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    return state.rax;
+}
+
+static void reset_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "reset_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+
+    res = ivee_set_reset_policy(ivee, IVEE_RESET_ON_CALL);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+
+    /* Yielded call keeps its state, but a new call abandoning it starts from the snapshot */
+    ivee_arch_state_t state = { .rcx = 1 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+    CU_ASSERT_EQUAL(state.rax, 3);
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+
+    res = ivee_set_reset_policy(ivee, IVEE_RESET_MANUAL);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+    CU_ASSERT_EQUAL(call_counter(ivee), 4);
+
+    res = ivee_reset(ivee);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(call_counter(ivee), 3);
+
+    /* Memory is a private view of the snapshot now */
+    ivee_t* clone = NULL;
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_EQUAL(res, -EBUSY);
+
+    ivee_destroy(ivee);
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "reset_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_clone(ivee, &clone);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Clone that has already run snapshots its own state, not the template one */
+    CU_ASSERT_EQUAL(call_counter(clone), 1);
+
+    res = ivee_set_reset_policy(clone, IVEE_RESET_ON_CALL);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(clone), 2);
+    CU_ASSERT_EQUAL(call_counter(clone), 2);
+
+    ivee_destroy(clone);
+    ivee_destroy(ivee);
+}
+
+/*
+ * Memory layout test: run a payload using stack and heap in a guest with more than 4GiB of memory
+ */
+static void memory_layout_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_memory_layout_t layout;
+
+    ivee_config_t config = {
+        .memory_size = 8ull << 30,
+        .heap_size = 1ull << 20,
+        .heap_base = 6ull << 30,
+    };
+
+    res = ivee_create_config(0, &config, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "stack_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_memory_layout(ivee, &layout);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(layout.memory_size, config.memory_size);
+    CU_ASSERT_EQUAL(layout.heap_base, config.heap_base);
+    CU_ASSERT_EQUAL(layout.stack_top - layout.stack_base, 64ull << 10);
+    CU_ASSERT_TRUE(layout.stack_top <= layout.page_table_base);
+    CU_ASSERT_TRUE(layout.page_table_base + layout.page_table_size <= layout.memory_size);
+
+    ivee_arch_state_t state = {
+        .rcx = 21,
+        .rdx = layout.heap_base + layout.heap_size - 8,
+    };
+
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 42);
+
+    ivee_destroy(ivee);
+
+    /* Stack can't go where page tables are */
+    config = (ivee_config_t) { .stack_top = 1ull << 30 };
+    res = ivee_create_config(0, &config, &ivee);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+}
+
+/*
+ * Extended state test: vector registers, RSP and RFLAGS go through a call and come back
+ */
+static void ext_state_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_memory_layout_t layout;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_memory_layout(ivee, &layout);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = {
+        .rbp = 0x1234ul,
+        .rcx = 1,
+        .rdx = 2,
+    };
+
+    static ivee_arch_state_ext_t ext;
+    ext.mask = IVEE_ARCH_STATE_RSP_RFLAGS | IVEE_ARCH_STATE_XMM;
+    ext.rsp = layout.stack_top - 0x100;
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            ext.zmm[i][j] = (uint8_t)(i * 16 + j);
+        }
+    }
+
+    res = ivee_call_ext(ivee, &state, &ext);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 3);
+    CU_ASSERT_EQUAL(state.rbp, 0x1234ul);
+    CU_ASSERT_EQUAL(ext.rsp, layout.stack_top - 0x100);
+    CU_ASSERT_TRUE(ext.rflags & 0x2);
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            CU_ASSERT_EQUAL(ext.zmm[i][j], (uint8_t)(i * 16 + j));
+        }
+    }
+
+    /* Unknown state classes are rejected */
+    ext.mask = 1u << 31;
+    res = ivee_call_ext(ivee, &state, &ext);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Vector test: guest can use whatever AVX flavor it is told it has.
+ * Hosts that don't let guests have AVX skip the corresponding part.
+ */
+static void vector_test_run(uint64_t rcx, uint32_t mask, size_t lanes)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "vector_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = { .rcx = rcx };
+    static ivee_arch_state_ext_t ext;
+    ext.mask = mask;
+    for (size_t i = 0; i < lanes; ++i) {
+        ((uint64_t*)ext.zmm[0])[i] = i + 1;
+        ((uint64_t*)ext.zmm[1])[i] = (i + 1) * 10;
+    }
+
+    res = ivee_call_ext(ivee, &state, &ext);
+    CU_ASSERT_TRUE(res == 0);
+    for (size_t i = 0; i < lanes; ++i) {
+        CU_ASSERT_EQUAL(((uint64_t*)ext.zmm[0])[i], (i + 1) * 11);
+    }
+
+    ivee_destroy(ivee);
+}
+
+static void vector_test(void)
+{
+    uint64_t features = ivee_list_cpu_features();
+    if (features & IVEE_CPU_AVX2) {
+        vector_test_run(0, IVEE_ARCH_STATE_YMM, 4);
+    }
+
+    if (features & IVEE_CPU_AVX512F) {
+        vector_test_run(1, IVEE_ARCH_STATE_ZMM, 8);
+    }
+}
+
+/*
+ * Hypercall test: guest calls into a registered host function and resumes with its result
+ */
+static uint64_t hypercall_test_add(ivee_t* ivee, void* ctx, const uint64_t args[IVEE_HYPERCALL_ARGS])
+{
+    ++*(int*)ctx;
+    return args[0] + args[1];
+}
+
+static void hypercall_test(void)
+{
+    int res = 0;
+    int ncalls = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "hypercall_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_register_hypercall(ivee, 1, hypercall_test_add, &ncalls);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_register_hypercall(ivee, IVEE_HYPERCALL_MAX, hypercall_test_add, &ncalls);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    ivee_arch_state_t state = {
+        .rcx = 0xDEADF00Dul,
+        .rdx = 0xCAFEBABEul,
+    };
+
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 0xDEADF00Dul + 0xCAFEBABEul);
+    CU_ASSERT_EQUAL(state.rcx, (uint64_t)-ENOSYS);
+    CU_ASSERT_EQUAL(ncalls, 1);
+
+    /* Unregistered hypercall fails in the guest, not in the host */
+    res = ivee_register_hypercall(ivee, 1, NULL, NULL);
+    CU_ASSERT_TRUE(res == 0);
+
+    state = (ivee_arch_state_t) { .rcx = 1, .rdx = 2 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, (uint64_t)-ENOSYS);
+    CU_ASSERT_EQUAL(ncalls, 1);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Yield test: guest suspends a call several times, host resumes it with new register values
+ */
+static void yield_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "yield_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = { 0 };
+
+    /* Nothing to resume yet */
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    state.rcx = 3;
+    res = ivee_call(ivee, &state);
+    for (uint64_t i = 0; i < 3; ++i) {
+        CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+        CU_ASSERT_EQUAL(state.rax, i);
+
+        state.rax = (i + 1) * 10;
+        res = ivee_resume(ivee, &state);
+    }
+
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 10 + 20 + 30);
+
+    /* Finished call can't be resumed */
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    /* New call abandons a yielded one */
+    state = (ivee_arch_state_t) { .rcx = 2 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, IVEE_CALL_YIELDED);
+
+    state = (ivee_arch_state_t) { .rcx = 0 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 0);
+
+    res = ivee_resume(ivee, &state);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Buffer test: guest works on registered host memory in place
+ */
+static void buffer_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_memory_layout_t layout;
+    uint64_t gpa = 0;
+
+    const size_t length = 4ull << 20;
+    const size_t count = length / sizeof(uint64_t);
+    uint64_t* buf = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CU_ASSERT_FATAL(buf != MAP_FAILED);
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        buf[i] = i;
+        sum += i;
+    }
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Nothing is loaded yet */
+    res = ivee_register_buffer(ivee, buf, length, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gpa);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    res = ivee_load_executable(ivee, "buffer_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_register_buffer(ivee, (uint8_t*)buf + 1, length - 4096, IVEE_BUFFER_READ, &gpa);
+    CU_ASSERT_EQUAL(res, -EINVAL);
+
+    res = ivee_register_buffer(ivee, buf, length, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gpa);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_memory_layout(ivee, &layout);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE(gpa >= layout.buffer_base && gpa + length <= layout.buffer_base + layout.buffer_size);
+
+    /* Second buffer gets its own range */
+    uint64_t gpa2 = 0;
+    res = ivee_register_buffer(ivee, buf, 4096, IVEE_BUFFER_READ, &gpa2);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE(gpa2 + 4096 <= gpa || gpa2 >= gpa + length);
+
+    /* Guest sees host data and host sees guest writes with no copies in between */
+    for (int i = 0; i < 2; ++i) {
+        ivee_arch_state_t state = { .rcx = gpa, .rdx = count };
+        res = ivee_call(ivee, &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, sum + i * count);
+    }
+
+    CU_ASSERT_EQUAL(buf[0], 2);
+    CU_ASSERT_EQUAL(buf[count - 1], count + 1);
+
+    /* Read-only buffer can't be written by guest */
+    ivee_arch_state_t state = { .rcx = gpa2, .rdx = 1 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res < 0);
+
+    res = ivee_unregister_buffer(ivee, gpa2);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_unregister_buffer(ivee, gpa2);
+    CU_ASSERT_EQUAL(res, -ENOENT);
+
+    res = ivee_unregister_buffer(ivee, gpa);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Buffer is gone from guest but memory is still ours */
+    state = (ivee_arch_state_t) { .rcx = gpa, .rdx = 1 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res < 0);
+    CU_ASSERT_EQUAL(buf[0], 2);
+
+    /* Failed guest read does not leak into the next call */
+    res = ivee_register_buffer(ivee, buf, length, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gpa);
+    CU_ASSERT_TRUE(res == 0);
+
+    state = (ivee_arch_state_t) { .rcx = gpa, .rdx = count };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, sum + 2 * count);
+
+    ivee_destroy(ivee);
+    munmap(buf, length);
+}
+
+/*
+ * Memory slots test: many buffers, adjacent ones coalesced and scattered ones each in its own slot
+ */
+static void memory_slots_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+
+    const size_t npages = 128;
+    uint64_t gpa[128];
+    uint64_t* buf = mmap(NULL, npages * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CU_ASSERT_FATAL(buf != MAP_FAILED);
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "buffer_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Every other page, so that host memory is never contiguous */
+    for (size_t i = 0; i < npages; i += 2) {
+        res = ivee_register_buffer(ivee, (uint8_t*)buf + i * 4096, 4096, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gpa[i]);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    /* Fill the gaps, buffers end up in one contiguous GPA range */
+    for (size_t i = 1; i < npages; i += 2) {
+        res = ivee_register_buffer(ivee, (uint8_t*)buf + i * 4096, 4096, IVEE_BUFFER_READ | IVEE_BUFFER_WRITE, &gpa[i]);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    for (size_t i = 0; i < npages; ++i) {
+        buf[i * 512] = i;
+    }
+
+    for (size_t i = 0; i < npages; ++i) {
+        ivee_arch_state_t state = { .rcx = gpa[i], .rdx = 1 };
+        res = ivee_call(ivee, &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, i);
+    }
+
+    ivee_destroy(ivee);
+    munmap(buf, npages * 4096);
+}
+
+/*
+ * Batch test: guest queues a page of hypercalls and runs them with a single exit
+ */
+static void batch_test(void)
+{
+    int res = 0;
+    int ncalls = 0;
+    ivee_t* ivee = NULL;
+    ivee_stats_t stats;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "batch_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_register_hypercall(ivee, 1, hypercall_test_add, &ncalls);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = {
+        .rcx = IVEE_BATCH_ENTRIES,
+        .rdx = 1000,
+    };
+
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, IVEE_BATCH_ENTRIES);
+    CU_ASSERT_EQUAL(state.rbx, IVEE_BATCH_ENTRIES * (IVEE_BATCH_ENTRIES - 1) / 2 + IVEE_BATCH_ENTRIES * 1000);
+    CU_ASSERT_EQUAL(ncalls, IVEE_BATCH_ENTRIES);
+
+    /* Doorbell and return are the only exits */
+    res = ivee_get_stats(ivee, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.io_exits, 2);
+
+    /* Batch that does not fit in a page is rejected as a whole */
+    state = (ivee_arch_state_t) { .rcx = IVEE_BATCH_ENTRIES + 1 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, (uint64_t)-EINVAL);
+    CU_ASSERT_EQUAL(ncalls, IVEE_BATCH_ENTRIES);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Service test: requests go through a ring to a guest loop that stays in the guest
+ */
+static void service_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_service_t* svc = NULL;
+    ivee_memory_layout_t layout;
+    ivee_stats_t stats;
+    uint64_t result = 0;
+
+    ivee_config_t config = {
+        .heap_size = 1ull << 20,
+    };
+
+    res = ivee_create_config(0, &config, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "service_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_memory_layout(ivee, &layout);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Call timeout must not cut the resident loop short */
+    res = ivee_set_call_timeout(ivee, 10000000);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = { 0 };
+    res = ivee_service_start(ivee, layout.heap_base, &state, &svc);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (uint64_t i = 0; i < 1000; ++i) {
+        const uint64_t args[IVEE_HYPERCALL_ARGS] = { i, 1000 };
+        res = ivee_service_call(svc, 0, args, &result);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(result, i + 1000);
+    }
+
+    /* Fill the whole ring before collecting anything */
+    for (uint64_t i = 0; i < IVEE_SERVICE_RING_ENTRIES; ++i) {
+        const uint64_t args[IVEE_HYPERCALL_ARGS] = { i, i };
+        res = ivee_service_submit(svc, 0, args);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    const uint64_t args[IVEE_HYPERCALL_ARGS] = { 0 };
+    res = ivee_service_submit(svc, 0, args);
+    CU_ASSERT_EQUAL(res, -EAGAIN);
+
+    for (uint64_t i = 0; i < IVEE_SERVICE_RING_ENTRIES; ++i) {
+        res = ivee_service_complete(svc, &result);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(result, i * 2);
+    }
+
+    res = ivee_service_complete(svc, &result);
+    CU_ASSERT_EQUAL(res, -ENOENT);
+
+    /* Let guest go idle and wake it up */
+    usleep(100000);
+    const uint64_t idle_args[IVEE_HYPERCALL_ARGS] = { 1, 2 };
+    res = ivee_service_call(svc, 0, idle_args, &result);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(result, 3);
+
+    res = ivee_service_stop(svc, &state);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_get_stats(ivee, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.calls, 1);
+    CU_ASSERT_TRUE(stats.hlt_exits > 0);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Image smoke test: load one parsed image into several environments, each gets its own writable data
+ */
+static void image_smoke_test(void)
+{
+    int res = 0;
+    ivee_image_t* img = NULL;
+    ivee_t* ivee[2] = { NULL };
+
+    res = ivee_image_open("reset_test_payload.elf64", IVEE_EXEC_ELF64, &img);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (size_t i = 0; i < 2; ++i) {
+        res = ivee_create(0, &ivee[i]);
+        CU_ASSERT_TRUE(res == 0);
+
+        res = ivee_load_image(ivee[i], img);
+        CU_ASSERT_TRUE(res == 0);
+    }
+
+    /* Environments outlive the image */
+    ivee_image_close(img);
+
+    CU_ASSERT_EQUAL(call_counter(ivee[0]), 1);
+    CU_ASSERT_EQUAL(call_counter(ivee[0]), 2);
+    CU_ASSERT_EQUAL(call_counter(ivee[1]), 1);
+
+    ivee_destroy(ivee[0]);
+    ivee_destroy(ivee[1]);
+}
+
+/*
+ * Async smoke test: complete a couple of asynchronous calls through eventfd polling and waiting
+ */
+static void async_smoke_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_call_t* call = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "smoke_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = {
+        .rcx = 0xDEADF00Dul,
+        .rdx = 0xCAFEBABEul,
+    };
+
+    res = ivee_call_async(ivee, &state, &call);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* One call in flight at a time */
+    ivee_call_t* other = NULL;
+    res = ivee_call_async(ivee, &state, &other);
+    CU_ASSERT_EQUAL(res, -EBUSY);
+
+    struct pollfd pfd = {
+        .fd = ivee_call_fd(call),
+        .events = POLLIN,
+    };
+
+    res = poll(&pfd, 1, -1);
+    CU_ASSERT_EQUAL(res, 1);
+    CU_ASSERT_EQUAL(ivee_call_poll(call), 0);
+    CU_ASSERT_EQUAL(state.rax, 0xDEADF00Dul + 0xCAFEBABEul);
+    ivee_call_release(call);
+
+    /* Released eventfd is not readable */
+    res = poll(&pfd, 1, 0);
+    CU_ASSERT_EQUAL(res, 0);
+
+    state.rcx = 1;
+    state.rdx = 2;
+    res = ivee_call_async(ivee, &state, &call);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(ivee_call_wait(call), 0);
+    CU_ASSERT_EQUAL(state.rax, 3);
+    ivee_call_release(call);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Timeout test: runaway call is stopped by its deadline or by cancellation, environment stays usable
+ */
+static void timeout_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_call_t* call = NULL;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "spin_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_set_call_timeout(ivee, 10000000ull);
+    CU_ASSERT_TRUE(res == 0);
+
+    ivee_arch_state_t state = { .rcx = 1 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_EQUAL(res, -ETIMEDOUT);
+
+    state = (ivee_arch_state_t) { .rcx = 0, .rdx = 42 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 42);
+
+    res = ivee_set_call_timeout(ivee, 0);
+    CU_ASSERT_TRUE(res == 0);
+
+    state = (ivee_arch_state_t) { .rcx = 1 };
+    res = ivee_call_async(ivee, &state, &call);
+    CU_ASSERT_TRUE(res == 0);
+
+    /* Cancellation only affects a running call, so keep trying until worker picks it up */
+    while (ivee_call_poll(call) == -EAGAIN) {
+        ivee_cancel(ivee);
+        usleep(1000);
+    }
+
+    CU_ASSERT_EQUAL(ivee_call_wait(call), -ECANCELED);
+    ivee_call_release(call);
+
+    state = (ivee_arch_state_t) { .rcx = 0, .rdx = 42 };
+    res = ivee_call(ivee, &state);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(state.rax, 42);
+
+    ivee_destroy(ivee);
+}
+
+/*
+ * Stats test: check that calls and exits are accounted for
+ */
+static void stats_test(void)
+{
+    int res = 0;
+    ivee_t* ivee = NULL;
+    ivee_stats_t stats;
+
+    res = ivee_create(0, &ivee);
+    CU_ASSERT_TRUE(res == 0);
+
+    res = ivee_load_executable(ivee, "reset_test_payload.elf64", IVEE_EXEC_ELF64);
+    CU_ASSERT_TRUE(res == 0);
+
+    CU_ASSERT_EQUAL(call_counter(ivee), 1);
+    CU_ASSERT_EQUAL(call_counter(ivee), 2);
+
+    res = ivee_get_stats(ivee, &stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_EQUAL(stats.calls, 2);
+    CU_ASSERT_EQUAL(stats.failed_calls, 0);
+    CU_ASSERT_EQUAL(stats.runs, 2);
+    CU_ASSERT_EQUAL(stats.io_exits, 2);
+    CU_ASSERT_EQUAL(stats.pio_ports[0].exits, 2);
+    CU_ASSERT_TRUE(stats.run_cycles > 0);
+
+    uint64_t hist_calls = 0;
+    for (size_t i = 0; i < IVEE_STATS_HISTOGRAM_BUCKETS; ++i) {
+        hist_calls += stats.call_cycles[i];
+    }
+    CU_ASSERT_EQUAL(hist_calls, 2);
+    CU_ASSERT_TRUE(ivee_stats_percentile(&stats, 50) <= ivee_stats_percentile(&stats, 100));
+
+    ivee_destroy(ivee);
+
+    /* Destroyed instance is still accounted for globally */
+    res = ivee_get_global_stats(&stats);
+    CU_ASSERT_TRUE(res == 0);
+    CU_ASSERT_TRUE(stats.calls >= 2);
+}
+
+/*
+ * Pool smoke test: acquire environments up to the pool limit, call each and give them back
+ */
+static void pool_smoke_test(void)
+{
+    int res = 0;
+    ivee_pool_t* pool = NULL;
+    ivee_t* ivee[4] = { NULL };
+
+    res = ivee_pool_create(0, "smoke_test_payload.bin", IVEE_EXEC_BIN, 2, 4, &pool);
+    CU_ASSERT_TRUE(res == 0);
+
+    for (size_t i = 0; i < 4; ++i) {
+        res = ivee_pool_acquire(pool, &ivee[i]);
+        CU_ASSERT_TRUE(res == 0);
+
+        ivee_arch_state_t state = {
+            .rcx = i,
+            .rdx = 0xCAFEBABEul,
+        };
+
+        res = ivee_call(ivee[i], &state);
+        CU_ASSERT_TRUE(res == 0);
+        CU_ASSERT_EQUAL(state.rax, i + 0xCAFEBABEul);
+    }
+
+    ivee_t* extra = NULL;
+    res = ivee_pool_acquire(pool, &extra);
+    CU_ASSERT_EQUAL(res, -EAGAIN);
+
+    for (size_t i = 0; i < 4; ++i) {
+        ivee_pool_release(pool, ivee[i]);
+    }
+
+    /* Released environments are reused */
+    res = ivee_pool_acquire(pool, &extra);
+    CU_ASSERT_TRUE(res == 0);
+    ivee_pool_release(pool, extra);
+
+    ivee_pool_destroy(pool);
+}
+
 int main(int argc, char** argv)
 {
     if (CUE_SUCCESS != CU_initialize_registry()) {
@@ -61,6 +912,22 @@ int main(int argc, char** argv)
 
     CU_add_test(suite, "raw_binary_smoke_test", raw_binary_smoke_test);
     CU_add_test(suite, "elf64_smoke_test", elf64_smoke_test);
+    CU_add_test(suite, "clone_smoke_test", clone_smoke_test);
+    CU_add_test(suite, "reset_test", reset_test);
+    CU_add_test(suite, "memory_layout_test", memory_layout_test);
+    CU_add_test(suite, "ext_state_test", ext_state_test);
+    CU_add_test(suite, "vector_test", vector_test);
+    CU_add_test(suite, "hypercall_test", hypercall_test);
+    CU_add_test(suite, "yield_test", yield_test);
+    CU_add_test(suite, "batch_test", batch_test);
+    CU_add_test(suite, "buffer_test", buffer_test);
+    CU_add_test(suite, "memory_slots_test", memory_slots_test);
+    CU_add_test(suite, "service_test", service_test);
+    CU_add_test(suite, "image_smoke_test", image_smoke_test);
+    CU_add_test(suite, "stats_test", stats_test);
+    CU_add_test(suite, "async_smoke_test", async_smoke_test);
+    CU_add_test(suite, "timeout_test", timeout_test);
+    CU_add_test(suite, "pool_smoke_test", pool_smoke_test);
 
     /* run tests */
     CU_basic_set_mode(CU_BRM_VERBOSE);